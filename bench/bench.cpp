@@ -0,0 +1,148 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "bench.h"
+#include "file.h"
+#include "reader.h"
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+// Every allocation of the process is counted, aligned and sized variants end up here too
+void *operator new(size_t size)
+{
+    syncopy::bench::allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+using namespace syncopy;
+
+int main(int argc, char *argv[])
+{
+    std::string filter;
+    std::string dir = "/tmp";
+    size_t size = 16 << 20;
+    unsigned runs = 5;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--size=", 0) == 0) {
+            size = std::stoul(arg.substr(7)) << 20;
+        } else if (arg.rfind("--runs=", 0) == 0) {
+            runs = std::stoul(arg.substr(7));
+        } else if (arg.rfind("--dir=", 0) == 0) {
+            dir = arg.substr(6);
+        } else if (arg == "--mmap") {
+            Reader::options.backend = Reader::Backend::Mmap;
+        } else if (arg[0] == '-') {
+            std::cout << argv[0] << " [FILTER] [--size=MB] [--runs=N] [--dir=DIR] [--mmap]" << std::endl;
+            return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else {
+            filter = arg;
+        }
+    }
+
+    bench::Generator gen(42);
+    bench::Runner runner(runs, filter);
+    auto data = gen.random(size);
+    volatile uint32_t sink = 0;
+
+    runner.run("adler32/eat", data.size(), [&] {
+        checksum::Adler32 adler(0);
+        for (auto b : data)
+            adler.eat(b);
+        sink = adler.hash();
+    });
+
+    const uint32_t window = 1000;
+    runner.run("adler32/update", data.size(), [&] {
+        checksum::Adler32 adler(window);
+        for (size_t i = 0; i < window; ++i)
+            adler.eat(data[i]);
+        for (size_t i = window; i < data.size(); ++i)
+            adler.update(data[i], data[i - window]);
+        sink = adler.hash();
+    });
+
+    File dst(dir + "/syncopy_bench_dst");
+    File src(dir + "/syncopy_bench_src");
+    dst.write(data);
+
+    for (uint32_t w : {512u, 1000u, 4096u, 65536u}) {
+        runner.run("signature/" + std::to_string(w), data.size(), [&] {
+            sink = dst.signature(w).chunks.size();
+        });
+    }
+    runner.run("compact/1000", data.size(), [&] {
+        sink = dst.compactSignature(window).size();
+    });
+
+    auto sig = dst.compactSignature(window);
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> patterns = {
+        {"identical", data},
+        {"inserts", gen.inserts(data, 64 << 10, 16)},
+        {"shifted", gen.shifted(data, 7)},
+        {"nomatch", gen.random(size)},
+    };
+    for (auto &p : patterns) {
+        if (!runner.enabled("delta/" + p.first))
+            continue;
+        src.write(p.second);
+        runner.run("delta/" + p.first, p.second.size(), [&] {
+            sink = src.delta(sig, size_t(-1), {}).chunks.size();
+        });
+    }
+
+    if (runner.enabled("delta/lowentropy")) {
+        auto low = gen.lowEntropy(size);
+        File other(dir + "/syncopy_bench_low");
+        other.write(low);
+        auto changed = gen.inserts(low, 64 << 10, 16);
+        src.write(changed);
+        // Adler32 alone matches many windows of few symbols, each checked by md5
+        for (auto hash : {CompactSignature::Hash::Rolling64, CompactSignature::Hash::Adler32}) {
+            auto low_sig = other.compactSignature(window, 0, size_t(-1), hash);
+            auto name = std::string("delta/lowentropy") + (hash == CompactSignature::Hash::Adler32 ? "/adler32" : "");
+            runner.run(name, changed.size(), [&] {
+                sink = src.delta(low_sig, size_t(-1), {}).chunks.size();
+            });
+        }
+        other.remove();
+    }
+
+    if (runner.enabled("patch/")) {
+        auto changed = gen.inserts(data, 64 << 10, 16);
+        src.write(changed);
+        auto delta = src.delta(sig, size_t(-1), {});
+        runner.run("patch/inserts", changed.size(), [&] {
+            if (!dst.patch(delta))
+                std::cerr << "Could not patch: " << dst.path() << std::endl;
+        }, [&] {
+            dst.write(data);
+        });
+        size_t threads = std::max(2u, std::thread::hardware_concurrency());
+        delta = src.delta(sig, size_t(-1), {}, true);
+        runner.run("patch/parallel", changed.size(), [&] {
+            if (!dst.patch(delta, threads))
+                std::cerr << "Could not patch: " << dst.path() << std::endl;
+        }, [&] {
+            dst.write(data);
+        });
+    }
+
+    src.remove();
+    dst.remove();
+    return EXIT_SUCCESS;
+}
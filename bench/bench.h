@@ -0,0 +1,163 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace syncopy
+{
+    namespace bench
+    {
+        // Calls of operator new, counted by the bench binary
+        inline std::atomic<size_t> allocations{0};
+
+        /**
+         * Deterministic data for benchmarks: the same seed gives the same bytes on every machine.
+         *
+         * @example:
+         *  Generator gen(42);
+         *  auto dst = gen.random(16 << 20);
+         *  auto src = gen.inserts(dst, 64 << 10, 16);
+         */
+        class Generator
+        {
+        public:
+            explicit Generator(uint64_t seed) : _state(seed ? seed : 1)
+            {
+            }
+
+            // xorshift64*
+            uint64_t next()
+            {
+                _state ^= _state >> 12;
+                _state ^= _state << 25;
+                _state ^= _state >> 27;
+                return _state * 0x2545f4914f6cdd1dULL;
+            }
+
+            std::vector<uint8_t> random(size_t size)
+            {
+                std::vector<uint8_t> result(size);
+                for (size_t i = 0; i < size; i += 8) {
+                    uint64_t v = next();
+                    for (size_t j = 0; j < 8 && i + j < size; ++j)
+                        result[i + j] = uint8_t(v >> (j * 8));
+                }
+
+                return result;
+            }
+
+            // Runs of a few symbols, like logs or sparse tables: weak hashes collide a lot
+            std::vector<uint8_t> lowEntropy(size_t size, unsigned symbols = 4)
+            {
+                std::vector<uint8_t> result;
+                result.reserve(size);
+                while (result.size() < size) {
+                    uint64_t v = next();
+                    size_t run = 1 + (v >> 8) % 64;
+                    result.insert(result.end(), std::min(run, size - result.size()), uint8_t('a' + v % symbols));
+                }
+
+                return result;
+            }
+
+            // Copy of data with `size` random bytes inserted every `step` bytes
+            std::vector<uint8_t> inserts(const std::vector<uint8_t> &data, size_t step, size_t size)
+            {
+                std::vector<uint8_t> result;
+                result.reserve(data.size() + data.size() / step * size + size);
+                for (size_t pos = 0; pos < data.size(); pos += step) {
+                    size_t at = pos + next() % step;
+                    size_t end = std::min(at, data.size());
+                    result.insert(result.end(), data.begin() + pos, data.begin() + end);
+                    auto bytes = random(size);
+                    result.insert(result.end(), bytes.begin(), bytes.end());
+                    result.insert(result.end(), data.begin() + end, data.begin() + std::min(pos + step, data.size()));
+                }
+
+                return result;
+            }
+
+            // Copy of data moved by `size` random bytes at the beginning
+            std::vector<uint8_t> shifted(const std::vector<uint8_t> &data, size_t size)
+            {
+                auto result = random(size);
+                result.insert(result.end(), data.begin(), data.end());
+                return result;
+            }
+
+        private:
+            uint64_t _state;
+        };
+
+        /**
+         * Runs benchmarks and prints MB/s and allocations per run.
+         * Every benchmark is run once to warm up and then `runs` times,
+         * the median time is reported. `setup` is called before every run and is not measured.
+         *
+         * @example:
+         *  Runner runner(5);
+         *  runner.run("adler32/eat", data.size(), [&] { ... });
+         */
+        class Runner
+        {
+        public:
+            explicit Runner(unsigned runs, const std::string &filter = {}) : _runs(std::max(runs, 1u)), _filter(filter)
+            {
+                std::cout << std::left << std::setw(32) << "benchmark"
+                          << std::right << std::setw(12) << "MB/s"
+                          << std::setw(12) << "ms"
+                          << std::setw(14) << "allocs/run" << std::endl;
+            }
+
+            bool enabled(const std::string &name) const
+            {
+                return _filter.empty() || name.find(_filter) != std::string::npos;
+            }
+
+            void run(const std::string &name, size_t bytes, const std::function<void()> &fn,
+                     const std::function<void()> &setup = {})
+            {
+                if (!enabled(name))
+                    return;
+
+                std::vector<double> times;
+                size_t allocs = 0;
+                for (unsigned i = 0; i <= _runs; ++i) {
+                    if (setup)
+                        setup();
+                    size_t before = allocations.load(std::memory_order_relaxed);
+                    auto start = std::chrono::steady_clock::now();
+                    fn();
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                    // The first run warms up caches
+                    if (i == 0)
+                        continue;
+                    allocs += allocations.load(std::memory_order_relaxed) - before;
+                    times.push_back(elapsed.count());
+                }
+
+                std::sort(times.begin(), times.end());
+                double seconds = times[times.size() / 2];
+                std::cout << std::left << std::setw(32) << name << std::right << std::fixed
+                          << std::setw(12) << std::setprecision(1) << (seconds > 0 ? bytes / seconds / (1 << 20) : 0)
+                          << std::setw(12) << std::setprecision(2) << seconds * 1000
+                          << std::setw(14) << allocs / _runs << std::endl;
+            }
+
+        private:
+            unsigned _runs;
+            std::string _filter;
+        };
+    }
+}
@@ -0,0 +1,381 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "bench.h"
+#include "proxy.h"
+#include "file.h"
+#include "scanner.h"
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+using namespace syncopy;
+
+/**
+ * Scripted workload: `setup` creates the initial tree, which is synced first,
+ * then `mutate` changes it and the second sync is measured.
+ */
+struct Workload
+{
+    std::string name;
+    std::function<void(const std::string &dir, bench::Generator &gen)> setup;
+    std::function<void(const std::string &dir, bench::Generator &gen)> mutate;
+};
+
+// Result of one run of the client
+struct Run
+{
+    bool ok = false;
+    double seconds = 0;
+    double client_cpu = 0;
+    double server_cpu = 0;
+    size_t up = 0;
+    size_t down = 0;
+    std::map<std::string, size_t> rpcs;
+};
+
+// Runs the binary with stdout and stderr appended to the log
+static pid_t spawn(const std::vector<std::string> &args, const std::string &log)
+{
+    pid_t pid = ::fork();
+    if (pid != 0)
+        return pid;
+
+    int fd = ::open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0) {
+        ::dup2(fd, STDOUT_FILENO);
+        ::dup2(fd, STDERR_FILENO);
+    }
+    std::vector<char *> argv;
+    for (auto &a : args)
+        argv.push_back(const_cast<char *>(a.c_str()));
+    argv.push_back(nullptr);
+    ::execv(argv[0], argv.data());
+    std::cerr << "Could not run: " << args[0] << std::endl;
+    ::_exit(127);
+}
+
+// User and system time of a running process
+static double cpu(pid_t pid)
+{
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    std::getline(in, line);
+    // Fields after the command, which may contain spaces
+    std::istringstream st(line.substr(line.rfind(')') + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && st >> field; ++i) {
+        if (i == 14)
+            utime = std::stoul(field);
+        else if (i == 15)
+            stime = std::stoul(field);
+    }
+
+    return double(utime + stime) / ::sysconf(_SC_CLK_TCK);
+}
+
+static bool connectable(uint16_t port)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    auto addr = bench::Proxy::loopback(port);
+    bool ok = fd >= 0 && ::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0;
+    if (fd >= 0)
+        ::close(fd);
+    return ok;
+}
+
+// Files of both trees have the same paths, sizes and content
+static bool same(const std::string &src, const std::string &dst)
+{
+    // Paths are relative to the tree
+    auto list = [] (const std::string &dir) {
+        std::map<std::string, size_t> result;
+        for (auto &e : Scanner(8).scan(dir))
+            result[e.path.substr(dir.size())] = e.dir() ? size_t(-1) : e.size;
+        return result;
+    };
+
+    auto a = list(src);
+    if (a != list(dst))
+        return false;
+
+    for (auto &e : a) {
+        if (e.second != size_t(-1) && File(src + e.first).md5() != File(dst + e.first).md5())
+            return false;
+    }
+
+    return true;
+}
+
+static void write(const std::string &path, const std::vector<uint8_t> &data)
+{
+    File f(path);
+    File::mkdir(f.parent_path());
+    f.write(data);
+}
+
+// Overwrites bytes in place, the size of the file is not changed
+static void edit(const std::string &path, size_t pos, const std::vector<uint8_t> &data)
+{
+    std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(pos);
+    f.write((const char *)data.data(), data.size());
+}
+
+static std::vector<Workload> workloads(size_t files, size_t size)
+{
+    auto name = [] (size_t i) {
+        return "d" + std::to_string(i % 100) + "/f" + std::to_string(i);
+    };
+
+    return {
+        {"tiny", [=] (const std::string &dir, bench::Generator &gen) {
+            for (size_t i = 0; i < files; ++i)
+                write(dir + "/" + name(i), gen.random(100 + gen.next() % 900));
+        }, [=] (const std::string &dir, bench::Generator &gen) {
+            for (size_t i = 0; i < files; i += 100)
+                write(dir + "/" + name(i), gen.random(100 + gen.next() % 900));
+        }},
+        {"huge", [=] (const std::string &dir, bench::Generator &gen) {
+            for (size_t i = 0; i < 4; ++i)
+                write(dir + "/huge" + std::to_string(i), gen.random(size));
+        }, [=] (const std::string &dir, bench::Generator &gen) {
+            for (size_t i = 0; i < 4; ++i) {
+                for (size_t j = 0; j < 64; ++j)
+                    edit(dir + "/huge" + std::to_string(i), gen.next() % (size - 100), gen.random(100));
+            }
+        }},
+        {"logs", [=] (const std::string &dir, bench::Generator &gen) {
+            for (size_t i = 0; i < 16; ++i)
+                write(dir + "/log" + std::to_string(i), gen.lowEntropy(size / 8, 26));
+        }, [=] (const std::string &dir, bench::Generator &gen) {
+            for (size_t i = 0; i < 16; ++i) {
+                File f(dir + "/log" + std::to_string(i));
+                for (size_t j = 0; j < 16; ++j)
+                    f.append(gen.lowEntropy(64 << 10, 26));
+            }
+        }},
+        {"renames", [=] (const std::string &dir, bench::Generator &gen) {
+            for (size_t i = 0; i < 1000; ++i)
+                write(dir + "/" + name(i), gen.random(64 << 10));
+        }, [=] (const std::string &dir, bench::Generator &) {
+            File::mkdir(dir + "/moved");
+            for (size_t i = 0; i < 1000; i += 2)
+                File(dir + "/" + name(i)).rename(dir + "/moved/f" + std::to_string(i));
+        }},
+        {"touches", [=] (const std::string &dir, bench::Generator &gen) {
+            for (size_t i = 0; i < files / 10; ++i)
+                write(dir + "/" + name(i), gen.random(4 << 10));
+        }, [=] (const std::string &dir, bench::Generator &) {
+            auto now = ::time(nullptr);
+            for (size_t i = 0; i < files / 10; ++i)
+                File(dir + "/" + name(i)).touch(now);
+        }},
+    };
+}
+
+/**
+ * Syncs the tree once by the client through the proxy and measures it.
+ */
+static Run sync(const std::string &client, const std::string &src, const std::vector<std::string> &flags,
+                bench::Proxy &proxy, pid_t server, const std::string &log)
+{
+    Run result;
+    proxy.reset();
+    double server_cpu = cpu(server);
+    std::vector<std::string> args = {client, src, "127.0.0.1", std::to_string(proxy.port()), "--once"};
+    args.insert(args.end(), flags.begin(), flags.end());
+    // Only the summary of this run is parsed
+    File(log).remove();
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = spawn(args, log);
+    int status = 0;
+    struct rusage usage = {};
+    ::wait4(pid, &status, 0, &usage);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    result.seconds = elapsed.count();
+    result.client_cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    result.server_cpu = cpu(server) - server_cpu;
+    result.up = proxy.up();
+    result.down = proxy.down();
+
+    std::ifstream in(log);
+    std::string word, name;
+    size_t count = 0;
+    while (in >> word) {
+        if (word == "rpc" && in >> name >> count)
+            result.rpcs[name] = count;
+    }
+
+    return result;
+}
+
+/**
+ * Merges Chrome traces of the client and server runs into one timeline.
+ * Processes keep their pids, timestamps of the monotonic clock are comparable.
+ */
+static void merge(const std::vector<std::string> &traces, const std::string &path)
+{
+    std::vector<std::string> parts;
+    for (auto &trace : traces) {
+        std::ifstream in(trace);
+        std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        auto begin = json.find('[');
+        auto end = json.rfind(']');
+        if (begin == std::string::npos || end == std::string::npos || end <= begin + 1)
+            continue;
+        auto events = json.substr(begin + 1, end - begin - 1);
+        if (events.find('{') != std::string::npos)
+            parts.push_back(events);
+        File(trace).remove();
+    }
+
+    std::ofstream out(path);
+    out << "{\"traceEvents\":[";
+    for (size_t i = 0; i < parts.size(); ++i)
+        out << (i ? "," : "") << parts[i];
+    out << "]}\n";
+}
+
+static void report(const std::string &name, const Run &run, bool same)
+{
+    size_t rpcs = 0;
+    std::ostringstream calls;
+    for (auto &c : run.rpcs) {
+        rpcs += c.second;
+        calls << " " << c.first << "=" << c.second;
+    }
+
+    std::cout << std::left << std::setw(20) << name << std::right << std::fixed
+              << std::setw(10) << std::setprecision(2) << run.seconds
+              << std::setw(12) << std::setprecision(2) << run.up / double(1 << 20)
+              << std::setw(12) << std::setprecision(2) << run.down / double(1 << 20)
+              << std::setw(10) << rpcs
+              << std::setw(10) << std::setprecision(2) << run.client_cpu
+              << std::setw(10) << std::setprecision(2) << run.server_cpu
+              << "  " << (!run.ok ? "FAILED" : same ? "ok" : "DIFF") << std::endl;
+    std::cout << "   rpc:" << calls.str() << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string filter;
+    std::string bin = "./bin";
+    std::string dir = "/tmp/syncopy_e2e";
+    size_t files = 100000;
+    size_t size = 64 << 20;
+    uint16_t port = 45670;
+    double latency = 0;
+    double bandwidth = 0;
+    std::vector<std::string> flags;
+    std::string trace;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = arg.substr(arg.find('=') + 1);
+        if (arg.rfind("--bin=", 0) == 0) {
+            bin = value;
+        } else if (arg.rfind("--dir=", 0) == 0) {
+            dir = value;
+        } else if (arg.rfind("--files=", 0) == 0) {
+            files = std::stoul(value);
+        } else if (arg.rfind("--size=", 0) == 0) {
+            size = std::stoul(value) << 20;
+        } else if (arg.rfind("--port=", 0) == 0) {
+            port = std::stoi(value);
+        } else if (arg.rfind("--latency=", 0) == 0) {
+            latency = std::stod(value);
+        } else if (arg.rfind("--bandwidth=", 0) == 0) {
+            bandwidth = std::stod(value);
+        } else if (arg.rfind("--trace=", 0) == 0) {
+            trace = value;
+        } else if (arg == "--mmap" || arg.rfind("--cache=", 0) == 0) {
+            flags.push_back(arg);
+        } else if (arg[0] == '-') {
+            std::cout << argv[0] << " [WORKLOAD] [--bin=DIR] [--dir=DIR] [--files=N] [--size=MB] [--port=N]"
+                      << " [--latency=MS] [--bandwidth=MBIT] [--trace=DIR] [--mmap] [--cache=keep|dontneed|direct]" << std::endl;
+            return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else {
+            filter = arg;
+        }
+    }
+
+    // Children are stopped by the harness, a dead client must not kill it
+    ::signal(SIGPIPE, SIG_IGN);
+    std::cout << "link: " << (latency ? std::to_string(latency) + "ms" : "no latency") << ", "
+              << (bandwidth ? std::to_string(bandwidth) + "Mbit/s" : "unlimited") << std::endl;
+    std::cout << std::left << std::setw(20) << "workload" << std::right
+              << std::setw(10) << "seconds" << std::setw(12) << "up MB" << std::setw(12) << "down MB"
+              << std::setw(10) << "rpcs" << std::setw(10) << "client s" << std::setw(10) << "server s" << std::endl;
+
+    bool failed = false;
+    for (auto &w : workloads(files, size)) {
+        if (!filter.empty() && w.name.find(filter) == std::string::npos)
+            continue;
+
+        bench::Generator gen(42);
+        auto src = dir + "/src";
+        auto dst = dir + "/dst";
+        File::rmdir(dir);
+        File::mkdir(src);
+        File::mkdir(dst);
+        w.setup(src, gen);
+
+        // Timelines of both sides, merged into DIR/WORKLOAD.json
+        auto traced = [&](const std::string &name) {
+            auto result = flags;
+            if (!trace.empty())
+                result.push_back("--trace=" + trace + "/" + w.name + "-" + name + ".json");
+            return result;
+        };
+        if (!trace.empty())
+            File::mkdir(trace);
+
+        std::vector<std::string> args = {bin + "/server", dst, "127.0.0.1", std::to_string(port)};
+        auto server_flags = traced("server");
+        args.insert(args.end(), server_flags.begin(), server_flags.end());
+        pid_t server = spawn(args, dir + "/server.log");
+        for (int i = 0; i < 500 && !connectable(port); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        bench::Proxy proxy(port, std::chrono::microseconds(int64_t(latency * 1000)), size_t(bandwidth * 1e6 / 8));
+        if (!connectable(port) || !proxy.listen(0)) {
+            std::cerr << "Could not start the server: " << dir << "/server.log" << std::endl;
+            ::kill(server, SIGTERM);
+            ::waitpid(server, nullptr, 0);
+            return EXIT_FAILURE;
+        }
+
+        auto client = bin + "/client";
+        auto log = dir + "/client.log";
+        auto initial = sync(client, src, traced("initial"), proxy, server, log);
+        report(w.name + "/initial", initial, same(src, dst));
+
+        // Changes must be seen by mtime, which has the resolution of a second
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        w.mutate(src, gen);
+        auto update = sync(client, src, traced("update"), proxy, server, log);
+        bool ok = same(src, dst);
+        report(w.name + "/update", update, ok);
+        failed |= !initial.ok || !update.ok || !ok;
+
+        proxy.stop();
+        ::kill(server, SIGTERM);
+        ::waitpid(server, nullptr, 0);
+        if (!trace.empty()) {
+            auto prefix = trace + "/" + w.name + "-";
+            merge({prefix + "server.json", prefix + "initial.json", prefix + "update.json"}, trace + "/" + w.name + ".json");
+        }
+    }
+
+    File::rmdir(dir);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
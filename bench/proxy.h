@@ -0,0 +1,263 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace syncopy
+{
+    namespace bench
+    {
+        /**
+         * TCP proxy on loopback which emulates a WAN link and counts bytes on the wire.
+         * Every direction of a connection is a link of `bandwidth` bytes per second
+         * (0 is unlimited): bytes leave it one after another and arrive `latency` later.
+         *
+         * @example:
+         *  Proxy proxy(4567, std::chrono::milliseconds(40), 10 << 20);
+         *  if (proxy.listen(0))
+         *      ... connect to proxy.port() ...
+         *  std::cout << proxy.up() << " " << proxy.down() << std::endl;
+         */
+        class Proxy
+        {
+        public:
+            using Clock = std::chrono::steady_clock;
+
+            Proxy(uint16_t target, Clock::duration latency, size_t bandwidth)
+                : _target(target), _latency(latency), _bandwidth(bandwidth)
+            {
+            }
+
+            ~Proxy()
+            {
+                stop();
+            }
+
+            // Listens on loopback, port 0 picks a free one
+            bool listen(uint16_t port)
+            {
+                _fd = ::socket(AF_INET, SOCK_STREAM, 0);
+                if (_fd < 0)
+                    return false;
+
+                int on = 1;
+                ::setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                auto addr = loopback(port);
+                socklen_t len = sizeof(addr);
+                if (::bind(_fd, (sockaddr *)&addr, len) != 0 || ::listen(_fd, 64) != 0
+                    || ::getsockname(_fd, (sockaddr *)&addr, &len) != 0) {
+                    std::cerr << "Could not listen on port: " << port << std::endl;
+                    return false;
+                }
+
+                _port = ntohs(addr.sin_port);
+                _acceptor = std::thread([this] { accept(); });
+                return true;
+            }
+
+            void stop()
+            {
+                if (_stopped.exchange(true))
+                    return;
+
+                if (_fd >= 0)
+                    ::shutdown(_fd, SHUT_RDWR);
+                if (_acceptor.joinable())
+                    _acceptor.join();
+                if (_fd >= 0)
+                    ::close(_fd);
+                std::lock_guard<std::mutex> locker(_mutex);
+                for (auto &link : _links)
+                    link->close();
+                for (auto &t : _threads)
+                    t.join();
+                for (int fd : _sockets)
+                    ::close(fd);
+                _threads.clear();
+                _links.clear();
+                _sockets.clear();
+            }
+
+            uint16_t port() const { return _port; }
+            // Bytes from clients to the target
+            size_t up() const { return _up; }
+            // Bytes from the target to clients
+            size_t down() const { return _down; }
+            size_t connections() const { return _connections; }
+
+            void reset()
+            {
+                _up = 0;
+                _down = 0;
+                _connections = 0;
+            }
+
+            static sockaddr_in loopback(uint16_t port)
+            {
+                sockaddr_in addr;
+                std::memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons(port);
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                return addr;
+            }
+
+        private:
+            // One direction of a connection: bytes read from `from` are delivered to `to` in time
+            class Link
+            {
+            public:
+                Link(int from, int to, std::atomic<size_t> &counter) : _from(from), _to(to), _counter(counter)
+                {
+                }
+
+                void read(Clock::duration latency, size_t bandwidth)
+                {
+                    std::vector<uint8_t> buf(64 << 10);
+                    // When the last byte leaves the sender
+                    auto sent = Clock::now();
+                    while (true) {
+                        ssize_t n = ::read(_from, buf.data(), buf.size());
+                        if (n <= 0)
+                            break;
+
+                        _counter += n;
+                        auto now = Clock::now();
+                        sent = std::max(sent, now);
+                        if (bandwidth)
+                            sent += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(double(n) / bandwidth));
+                        std::lock_guard<std::mutex> locker(_mutex);
+                        _queue.push_back({sent + latency, {buf.begin(), buf.begin() + n}});
+                        _cv.notify_one();
+                    }
+
+                    std::lock_guard<std::mutex> locker(_mutex);
+                    _eof = true;
+                    _cv.notify_one();
+                }
+
+                void write()
+                {
+                    while (true) {
+                        Packet p;
+                        {
+                            std::unique_lock<std::mutex> locker(_mutex);
+                            _cv.wait(locker, [&] { return !_queue.empty() || _eof || _closed; });
+                            if (_closed || _queue.empty())
+                                break;
+                            p = std::move(_queue.front());
+                            _queue.pop_front();
+                        }
+
+                        std::this_thread::sleep_until(p.arrival);
+                        for (size_t pos = 0; pos < p.data.size();) {
+                            ssize_t n = ::write(_to, p.data.data() + pos, p.data.size() - pos);
+                            if (n <= 0) {
+                                close();
+                                break;
+                            }
+                            pos += n;
+                        }
+                    }
+
+                    ::shutdown(_to, SHUT_WR);
+                }
+
+                void close()
+                {
+                    {
+                        std::lock_guard<std::mutex> locker(_mutex);
+                        _closed = true;
+                    }
+                    _cv.notify_one();
+                    ::shutdown(_from, SHUT_RDWR);
+                    ::shutdown(_to, SHUT_RDWR);
+                }
+
+            private:
+                struct Packet
+                {
+                    Clock::time_point arrival;
+                    std::vector<uint8_t> data;
+                };
+
+                int _from;
+                int _to;
+                std::atomic<size_t> &_counter;
+                std::mutex _mutex;
+                std::condition_variable _cv;
+                std::deque<Packet> _queue;
+                bool _eof = false;
+                bool _closed = false;
+            };
+
+            void accept()
+            {
+                while (!_stopped) {
+                    int client = ::accept(_fd, nullptr, nullptr);
+                    if (client < 0)
+                        break;
+
+                    int server = ::socket(AF_INET, SOCK_STREAM, 0);
+                    auto addr = loopback(_target);
+                    if (server < 0 || ::connect(server, (sockaddr *)&addr, sizeof(addr)) != 0) {
+                        std::cerr << "Could not connect to port: " << _target << std::endl;
+                        ::close(client);
+                        if (server >= 0)
+                            ::close(server);
+                        continue;
+                    }
+
+                    // Delays are emulated here, small rpc messages must not wait for Nagle
+                    int on = 1;
+                    ::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                    ::setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                    ++_connections;
+
+                    std::lock_guard<std::mutex> locker(_mutex);
+                    _links.emplace_back(new Link(client, server, _up));
+                    _links.emplace_back(new Link(server, client, _down));
+                    for (auto *link : {_links[_links.size() - 2].get(), _links.back().get()}) {
+                        _threads.emplace_back([this, link] { link->read(_latency, _bandwidth); });
+                        _threads.emplace_back([link] { link->write(); });
+                    }
+                    _sockets.push_back(client);
+                    _sockets.push_back(server);
+                }
+            }
+
+            uint16_t _target;
+            Clock::duration _latency;
+            size_t _bandwidth;
+            uint16_t _port = 0;
+            int _fd = -1;
+            std::atomic<bool> _stopped = {false};
+            std::atomic<size_t> _up = {0};
+            std::atomic<size_t> _down = {0};
+            std::atomic<size_t> _connections = {0};
+            std::thread _acceptor;
+            std::mutex _mutex;
+            std::vector<std::unique_ptr<Link>> _links;
+            std::vector<std::thread> _threads;
+            std::vector<int> _sockets;
+        };
+    }
+}
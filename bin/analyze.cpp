@@ -0,0 +1,207 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "file.h"
+#include "metrics.h"
+#include "scanner.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <sys/stat.h>
+
+// How a signature and a delta are created
+struct Policy
+{
+    std::string name;
+    std::function<syncopy::CompactSignature(const syncopy::File &, uint32_t)> signature;
+    std::function<syncopy::Delta(const syncopy::File &, const syncopy::CompactSignature &)> delta;
+};
+
+// Result of one window and policy
+struct Result
+{
+    std::string policy;
+    uint32_t window = 0;
+    size_t sig_bytes = 0;
+    size_t delta_bytes = 0;
+    size_t literal = 0;
+    double collisions = 0;
+    double seconds = 0;
+
+    size_t transfer() const { return sig_bytes + delta_bytes; }
+    // Compute plus sending both ways over the link of bandwidth bytes per second
+    double total(double bandwidth) const { return seconds + transfer() / bandwidth; }
+};
+
+static std::vector<Policy> policies()
+{
+    return {
+        {"adler32", [] (const syncopy::File &f, uint32_t window) {
+            return f.compactSignature(window, 0, size_t(-1), syncopy::CompactSignature::Hash::Adler32);
+        }, [] (const syncopy::File &f, const syncopy::CompactSignature &sig) {
+            return f.delta(sig, size_t(-1), {});
+        }},
+        {"rolling64", [] (const syncopy::File &f, uint32_t window) {
+            return f.compactSignature(window, 0, size_t(-1), syncopy::CompactSignature::Hash::Rolling64);
+        }, [] (const syncopy::File &f, const syncopy::CompactSignature &sig) {
+            return f.delta(sig, size_t(-1), {});
+        }},
+    };
+}
+
+template<class T>
+static size_t serialized(const T &value)
+{
+    std::ostringstream st;
+    value.serialize(st);
+    return st.str().size();
+}
+
+// Sums of all pairs of source and destination files
+static Result analyze(const Policy &policy, uint32_t window, const std::vector<std::pair<syncopy::File, syncopy::File>> &files)
+{
+    Result result;
+    result.policy = policy.name;
+    result.window = window;
+
+    auto &metrics = syncopy::Metrics::global();
+    auto before = metrics.snapshot();
+    for (auto &f : files) {
+        auto start = std::chrono::steady_clock::now();
+        auto sig = policy.signature(f.second, window);
+        auto delta = policy.delta(f.first, sig);
+        result.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        result.sig_bytes += serialized(sig);
+        result.delta_bytes += serialized(delta);
+        for (auto &chunk : delta.chunks)
+            result.literal += chunk.data.size();
+    }
+    auto after = metrics.snapshot();
+
+    // Rolling hashes found in the signature which had another md5, of all hashes
+    auto diff = [&](const std::string &name) {
+        double result = 0;
+        for (auto it = after.lower_bound(name); it != after.end() && it->first.compare(0, name.size(), name) == 0; ++it)
+            result += it->second - before[it->first];
+        return result;
+    };
+    double hits = diff("syncopy_delta_weak_hits_total");
+    double misses = diff("syncopy_delta_strong_misses_total");
+    result.collisions = hits > 0 ? misses / hits : 0;
+    return result;
+}
+
+static std::vector<uint32_t> windows(const std::string &list)
+{
+    std::vector<uint32_t> result;
+    std::istringstream st(list);
+    std::string item;
+    while (std::getline(st, item, ',')) {
+        if (!item.empty() && std::stoul(item) > 0)
+            result.push_back(std::stoul(item));
+    }
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> args;
+    std::string list = "256,512,1000,2048,4096,8192,16384,65536";
+    std::string only;
+    double bandwidth = 100;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.substr(0, 10) == "--windows=")
+            list = arg.substr(10);
+        else if (arg.substr(0, 12) == "--bandwidth=")
+            bandwidth = std::stod(arg.substr(12));
+        else if (arg.substr(0, 9) == "--policy=")
+            only = arg.substr(9);
+        else
+            args.push_back(arg);
+    }
+
+    auto sizes = windows(list);
+    if (args.size() < 2 || sizes.empty() || bandwidth <= 0) {
+        std::cout << argv[0] << " SOURCE_FILE|DIR DESTINATION_FILE|DIR [--windows=256,512,...] [--policy=NAME] [--bandwidth=MBIT]" << std::endl;
+        return 0;
+    }
+
+    // Files of two dirs are paired by their relative paths
+    std::vector<std::pair<syncopy::File, syncopy::File>> files;
+    size_t source = 0;
+    struct stat st;
+    if (stat(args[0].c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        for (auto &e : syncopy::Scanner(8).scan(args[0])) {
+            syncopy::File dst(args[1] + e.path.substr(args[0].size()));
+            if (!e.dir() && dst.exists()) {
+                files.push_back({syncopy::File(e.path), dst});
+                source += e.size;
+            }
+        }
+    } else if (syncopy::File(args[0]).exists() && syncopy::File(args[1]).exists()) {
+        files.push_back({syncopy::File(args[0]), syncopy::File(args[1])});
+        source = files[0].first.size();
+    }
+
+    if (files.empty()) {
+        std::cerr << "Could not find files to compare: " << args[0] << " " << args[1] << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "source           : " << args[0] << std::endl;
+    std::cout << "destination      : " << args[1] << std::endl;
+    std::cout << "files            : " << files.size() << ", " << source << " bytes" << std::endl;
+    std::cout << "bandwidth        : " << bandwidth << " Mbit/s" << std::endl;
+    std::cout << std::endl;
+    std::cout << std::left << std::setw(10) << "policy" << std::right << std::setw(8) << "window"
+              << std::setw(12) << "signature" << std::setw(12) << "delta" << std::setw(10) << "literal"
+              << std::setw(12) << "collisions" << std::setw(10) << "seconds" << std::setw(12) << "transfer"
+              << std::setw(10) << "total s" << std::endl;
+
+    double rate = bandwidth * 1e6 / 8;
+    source = std::max<size_t>(1, source);
+    std::vector<Result> results;
+    for (auto &policy : policies()) {
+        if (!only.empty() && policy.name != only)
+            continue;
+
+        for (auto window : sizes) {
+            auto r = analyze(policy, window, files);
+            results.push_back(r);
+            std::cout << std::left << std::setw(10) << r.policy << std::right << std::setw(8) << r.window
+                      << std::setw(12) << r.sig_bytes << std::setw(12) << r.delta_bytes
+                      << std::setw(9) << std::fixed << std::setprecision(1) << 100.0 * r.literal / source << "%"
+                      << std::setw(11) << std::setprecision(2) << 100 * r.collisions << "%"
+                      << std::setw(10) << std::setprecision(3) << r.seconds
+                      << std::setw(12) << r.transfer()
+                      << std::setw(10) << std::setprecision(3) << r.total(rate) << std::endl;
+        }
+    }
+
+    if (results.empty()) {
+        std::cerr << "Unknown policy: " << only << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto smallest = std::min_element(results.begin(), results.end(), [](const Result &a, const Result &b) {
+        return a.transfer() < b.transfer();
+    });
+    auto fastest = std::min_element(results.begin(), results.end(), [rate](const Result &a, const Result &b) {
+        return a.total(rate) < b.total(rate);
+    });
+
+    std::cout << std::endl;
+    std::cout << "least transfer   : " << smallest->policy << " window " << smallest->window
+              << ", " << smallest->transfer() << " bytes" << std::endl;
+    std::cout << "least total time : " << fastest->policy << " window " << fastest->window
+              << ", " << std::setprecision(3) << fastest->total(rate) << " s" << std::endl;
+
+    return EXIT_SUCCESS;
+}
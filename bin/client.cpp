@@ -3,125 +3,615 @@
  *********************************************************/
 
 #include "msg.h"
+#include "scheduler.h"
+#include "hashcache.h"
 #include "rpc/client.h"
 #include <iostream>
 #include <chrono>
 #include <thread>
+#include <deque>
+#include <atomic>
+#include <signal.h>
 
 const std::string syncopy_ext = ".syncopy";
+const size_t workers = 4;
+
+// Follow mode: how often hot files are checked, when collected bytes are sent
+// and when a file is not hot anymore
+const auto follow_poll = std::chrono::milliseconds(20);
+const auto follow_delay = std::chrono::milliseconds(100);
+const auto follow_idle = std::chrono::seconds(60);
+const size_t follow_batch = 64 << 10;
+
+// Once mode: passes over the tree before giving up to converge
+const size_t once_passes = 10;
+
+// State of a followed file
+struct Follow
+{
+    // Bytes synced with the server
+    size_t offset = 0;
+    // Read but not sent yet
+    std::vector<uint8_t> pending;
+    std::chrono::steady_clock::time_point since;
+    std::chrono::steady_clock::time_point changed;
+};
 
 class Syncopy
 {
 public:
-    Syncopy(std::string const &addr, uint16_t port) : client(addr, port) {}
+    Syncopy(std::string const &addr, uint16_t port) : client(addr, port), scheduler(workers) {}
 
     rpc::client client;
+    syncopy::Scheduler scheduler;
+    // Fingerprints of local files and of files known to be uploaded
+    syncopy::HashCache hashes;
+
+    // Files on the server found by the last scan
     std::mutex mutex;
-    std::condition_variable cv;
-    std::map<std::string, bool> pending;
-    bool quit = false;
+    std::map<std::string, syncopy::rpc::Stat> remote;
+
+    // Hot files streamed by the follower instead of being scheduled
+    bool follow = false;
+    std::mutex follow_mutex;
+    std::map<std::string, Follow> followed;
+    std::atomic<bool> quit = {false};
+
+    bool following(const std::string &path)
+    {
+        std::lock_guard<std::mutex> locker(follow_mutex);
+        return followed.find(path) != followed.end();
+    }
+
+    // Calls to the server are counted by name, waiting for replies is timed
+    template<class... Args>
+    auto call(const std::string &name, Args &&...args)
+    {
+        syncopy::Timer timer(count(name));
+        syncopy::Span span(name, {}, "rpc");
+        return client.call(name, std::forward<Args>(args)...);
+    }
+
+    template<class... Args>
+    auto async_call(const std::string &name, Args &&...args)
+    {
+        count(name);
+        return client.async_call(name, std::forward<Args>(args)...);
+    }
+
+    syncopy::Histogram &count(const std::string &name)
+    {
+        std::lock_guard<std::mutex> locker(calls_mutex);
+        auto &c = calls[name];
+        if (!c.second)
+            c.second = &syncopy::Metrics::global().histogram("syncopy_client_rpc_seconds", "Time of rpc calls to the server",
+                                                             "method=\"" + name + "\"");
+        ++c.first;
+        return *c.second;
+    }
+
+    std::mutex calls_mutex;
+    std::map<std::string, std::pair<size_t, syncopy::Histogram *>> calls;
+    // Files being synced by workers
+    syncopy::Gauge &inflight = syncopy::Metrics::global().gauge("syncopy_files_in_flight", "Files being synced");
+    syncopy::Gauge &queued = syncopy::Metrics::global().gauge("syncopy_queue_depth", "Files queued or being synced");
 };
 
-void worker(Syncopy &syncopy)
+/**
+ * Replaces literal blocks which already exist on the server by copies from the files containing them.
+ * The server is asked about all blocks of the delta in one call, which waits for the reply
+ * before the batch is sent, so it is skipped if the index of the server is empty.
+ */
+void dedup(Syncopy &syncopy, syncopy::Delta &delta, uint32_t window)
 {
-    while (true) {
-        std::unique_lock<std::mutex> locker(syncopy.mutex);
-        if (syncopy.pending.empty())
-            syncopy.cv.wait(locker, [&] { return !syncopy.pending.empty() || syncopy.quit; });
-        if (syncopy.quit)
-            break;
-        if (syncopy.pending.empty())
-            continue;
+    std::vector<std::string> md5s;
+    for (auto &chunk : delta.chunks) {
+        for (size_t pos = 0; pos + window <= chunk.data.size(); pos += window)
+            md5s.push_back(syncopy::checksum::md5(chunk.data.data() + pos, window));
+    }
 
-        std::string fn;
-        // Try to find available path to upload
-        for (auto it = syncopy.pending.begin(); it != syncopy.pending.end(); ++it) {
-            // Check if it is not being processed
-            if (!it->second) {
-                it->second = true;
-                fn = it->first;
-                break;
-            }
+    if (md5s.empty())
+        return;
+
+    auto found = syncopy.call("lookup", md5s).as<std::vector<syncopy::rpc::Location>>();
+    if (found.size() != md5s.size())
+        return;
+
+    std::vector<syncopy::Delta::Chunk> chunks;
+    size_t k = 0;
+    for (auto &chunk : delta.chunks) {
+        auto &data = chunk.data;
+        // Start of the literal data not replaced yet
+        size_t literal = 0;
+        for (size_t pos = 0; pos + window <= data.size(); pos += window, ++k) {
+            auto &loc = found[k];
+            if (loc.path.empty() || loc.size != window)
+                continue;
+
+            if (pos > literal)
+                chunks.push_back({size_t(-1), chunk.dst_pos + literal, {data.begin() + literal, data.begin() + pos}, pos - literal});
+            chunks.push_back({loc.pos, chunk.dst_pos + pos, {}, window, loc.path});
+            literal = pos + window;
         }
 
-        if (fn.empty())
-            continue;
-        locker.unlock();
+        if (literal == 0)
+            chunks.push_back(std::move(chunk));
+        else if (literal < data.size())
+            chunks.push_back({size_t(-1), chunk.dst_pos + literal, {data.begin() + literal, data.end()}, data.size() - literal});
+    }
+
+    delta.chunks = std::move(chunks);
+}
+
+/**
+ * Uploads a file using a session:
+ * the signature is received and the delta is sent in bounded batches,
+ * so neither side has to keep a whole message of the file size.
+ */
+bool upload(Syncopy &syncopy, const syncopy::Scheduler::Job &job)
+{
+    auto &fn = job.path;
+    auto info = syncopy.call("session_begin", fn, job.size).as<syncopy::rpc::SessionInfo>();
+    if (!info.id)
+        return false;
 
+    try {
         std::cout << fn << ": > signature ..." << std::endl;
-        auto rpcsig = syncopy.client.call("signature", fn).as<syncopy::rpc::Msg<syncopy::Signature>>();
-        auto sig = rpcsig.unpack();
-        std::cout << fn << ": < signature chunks: " << sig.chunks.size() << std::endl;
+        syncopy::CompactSignature sig;
+        for (size_t offset = 0;;) {
+            auto part = syncopy.call("session_signature", info.id, offset, syncopy::rpc::SIGNATURE_WINDOW)
+                .as<syncopy::rpc::Msg<syncopy::CompactSignature>>().unpack();
+            // An expired session or a broken reply has no window, the delta would never advance by it
+            if (part.window == 0) {
+                std::cerr << fn << ": could not receive signature" << std::endl;
+                syncopy.call("session_abort", info.id);
+                return false;
+            }
+            sig.window = part.window;
+            if (part.empty() && part.holes.empty())
+                break;
+            // A window of a sparse file may have holes only
+            offset = std::max(offset, part.end());
+            if (!part.holes.empty())
+                offset = std::max(offset, part.holes.back().pos + part.holes.back().size);
+            sig.append(part);
+        }
+        std::cout << fn << ": < signature chunks: " << sig.size() << std::endl;
+
         syncopy::File cur(fn);
         std::cout << fn << ": creating delta, size: " << cur.size() << std::endl;
-        auto delta = cur.delta(sig);
-        std::cout << fn << ": delta chunks: " << delta.chunks.size() << std::endl;
+
+        // Batches sent but not acknowledged yet, limited by the credit granted by the server
+        std::deque<std::pair<std::future<clmdep_msgpack::object_handle>, size_t>> inflight;
+        size_t inflight_size = 0;
+        size_t credit = info.credit;
+        uint64_t seq = 0;
+        auto ack = [&] {
+            credit = inflight.front().first.get().as<size_t>();
+            inflight_size -= inflight.front().second;
+            inflight.pop_front();
+            return credit > 0;
+        };
+
+        size_t chunks = 0;
+        auto delta = cur.delta(sig, syncopy::rpc::DELTA_BATCH, [&](syncopy::Delta &part) {
+            // The file has been changed again, no reason to continue
+            if (syncopy.scheduler.cancelled(job)) {
+                std::cout << fn << ": changed, cancelling" << std::endl;
+                return false;
+            }
+
+            if (info.blocks > 0)
+                dedup(syncopy, part, sig.window);
+            syncopy::rpc::Msg<syncopy::Delta> msg(part);
+            while (!inflight.empty() && inflight_size + msg.data.size() > credit) {
+                if (!ack())
+                    return false;
+            }
+
+            chunks += part.chunks.size();
+            inflight.emplace_back(syncopy.async_call("session_append", info.id, seq++, msg), msg.data.size());
+            inflight_size += msg.data.size();
+            return true;
+        });
+
+        while (!inflight.empty()) {
+            if (!ack())
+                delta = {};
+        }
+
+        if (delta.md5.empty()) {
+            syncopy.call("session_abort", info.id);
+            return false;
+        }
+
+        if (info.blocks > 0)
+            dedup(syncopy, delta, sig.window);
+        std::cout << fn << ": delta chunks: " << chunks + delta.chunks.size() << std::endl;
         std::cout << fn << ": > patching ..." << std::endl;
-        if (syncopy.client.call("patch", fn, syncopy::rpc::Msg<syncopy::Delta>(delta)).as<bool>())
-            std::cout << fn << ": < patched" << std::endl;
+        if (!syncopy.call("session_commit", info.id, syncopy::rpc::Msg<syncopy::Delta>(delta)).as<bool>())
+            return false;
+
+        // Not changed while the delta was being created
+        if (size_t(delta.st.st_size) == job.size && delta.st.st_mtime == job.mtime)
+            syncopy.hashes.set(fn, job.size, job.mtime, delta.md5);
+        return true;
+    } catch (const std::exception &e) {
+        std::cerr << fn << ": " << e.what() << std::endl;
+        syncopy.call("session_abort", info.id);
+    }
+
+    return false;
+}
+
+/**
+ * Finds a removed file with the same content as the new file.
+ * Sizes are compared first, md5 sums only for files of the same size.
+ * md5 sums of removed files are fetched from the server once and kept in remote.
+ * Returns the old path or empty string.
+ */
+std::string renamed(Syncopy &syncopy, const std::string &fn, const syncopy::rpc::Stat &st,
+    const std::map<std::string, syncopy::rpc::Stat> &vanished, std::map<std::string, std::string> &remote)
+{
+    std::string md5;
+    for (auto &v : vanished) {
+        if (v.second.size != st.size || st.size == 0)
+            continue;
+
+        if (md5.empty())
+            md5 = syncopy.hashes.md5(syncopy::File(fn));
+
+        auto it = remote.find(v.first);
+        if (it == remote.end()) {
+            std::string remote_md5;
+            if (!syncopy.hashes.find(v.first, v.second.size, v.second.mtime, remote_md5))
+                remote_md5 = syncopy.call("md5", v.first).as<std::string>();
+            it = remote.emplace(v.first, remote_md5).first;
+        }
+        auto &remote_md5 = it->second;
+
+        if (!md5.empty() && md5 == remote_md5)
+            return v.first;
+    }
+
+    return {};
+}
+
+/**
+ * Sends data to be appended at offset of the file on the server.
+ * The server checks if its last block is the same as here.
+ */
+bool appendTail(Syncopy &syncopy, const std::string &fn, size_t offset, const std::vector<uint8_t> &data)
+{
+    syncopy::File cur(fn);
+    size_t len = std::min<size_t>(syncopy::rpc::WINDOW, offset);
+    auto block = cur.read(offset - len, len);
+    if (block.size() != len)
+        return false;
+
+    auto md5 = syncopy::checksum::md5(block.data(), block.size());
+    return syncopy.call("append", fn, offset, md5, data, cur.mtime(), cur.mode()).as<bool>();
+}
+
+/**
+ * Appends the new tail of a file which only grew since the last sync.
+ * The old part is verified by md5 of the file on the server, which is usually cached there,
+ * instead of creating the signature and the delta of the whole file.
+ * A file also changed before its old end, like a rewritten image, is uploaded instead.
+ */
+bool append(Syncopy &syncopy, const syncopy::Scheduler::Job &job)
+{
+    size_t offset = 0;
+    {
+        std::lock_guard<std::mutex> locker(syncopy.mutex);
+        auto it = syncopy.remote.find(job.path);
+        if (it == syncopy.remote.end() || it->second.size == 0 || it->second.size >= job.size)
+            return false;
+        offset = it->second.size;
+    }
+
+    syncopy::File cur(job.path);
+    auto prefix = cur.md5(offset);
+    if (prefix.empty() || prefix != syncopy.call("md5", job.path).as<std::string>()) {
+        std::cout << job.path << ": changed before the old end, not appending" << std::endl;
+        return false;
+    }
+
+    while (offset < job.size) {
+        if (syncopy.scheduler.cancelled(job))
+            return false;
+
+        auto data = cur.read(offset, std::min(syncopy::rpc::DELTA_BATCH, job.size - offset));
+        if (data.empty())
+            return false;
+
+        std::cout << job.path << ": > appending " << data.size() << " bytes at " << offset << std::endl;
+        if (!appendTail(syncopy, job.path, offset, data))
+            return false;
+        offset += data.size();
+    }
+
+    if (syncopy.follow) {
+        std::lock_guard<std::mutex> locker(syncopy.follow_mutex);
+        auto &f = syncopy.followed[job.path];
+        f.offset = offset;
+        f.changed = std::chrono::steady_clock::now();
+        std::cout << job.path << ": following" << std::endl;
+    }
+
+    return true;
+}
+
+/**
+ * Streams new bytes of a followed file, batched by size and time.
+ * Returns false if the file should not be followed anymore.
+ */
+bool follow(Syncopy &syncopy, const std::string &fn, Follow &f)
+{
+    syncopy::File cur(fn);
+    if (!cur.exists())
+        return false;
+
+    auto now = std::chrono::steady_clock::now();
+    auto size = cur.size();
+    auto end = f.offset + f.pending.size();
+    // Truncated, the full sync is needed
+    if (size < end) {
+        syncopy.scheduler.push(fn, size, cur.mtime());
+        return false;
+    }
+
+    if (size > end) {
+        auto data = cur.read(end, std::min(size - end, follow_batch));
+        if (f.pending.empty())
+            f.since = now;
+        f.pending.insert(f.pending.end(), data.begin(), data.end());
+        f.changed = now;
+    }
+
+    if (!f.pending.empty() && (f.pending.size() >= follow_batch || now - f.since >= follow_delay)) {
+        if (!appendTail(syncopy, fn, f.offset, f.pending)) {
+            // Rewritten
+            syncopy.scheduler.push(fn, size, cur.mtime());
+            return false;
+        }
+        f.offset += f.pending.size();
+        f.pending.clear();
+    }
+
+    if (f.pending.empty() && now - f.changed > follow_idle) {
+        std::cout << fn << ": not following" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void follower(Syncopy &syncopy)
+{
+    syncopy::Trace::thread("follower");
+    while (!syncopy.quit) {
+        std::this_thread::sleep_for(follow_poll);
+
+        std::vector<std::string> paths;
+        {
+            std::lock_guard<std::mutex> locker(syncopy.follow_mutex);
+            for (auto &f : syncopy.followed)
+                paths.push_back(f.first);
+        }
+
+        for (auto &fn : paths) {
+            Follow f;
+            {
+                std::lock_guard<std::mutex> locker(syncopy.follow_mutex);
+                f = std::move(syncopy.followed[fn]);
+            }
+
+            bool ok = false;
+            try {
+                ok = follow(syncopy, fn, f);
+            } catch (const std::exception &e) {
+                std::cerr << fn << ": " << e.what() << std::endl;
+            }
+
+            std::lock_guard<std::mutex> locker(syncopy.follow_mutex);
+            if (ok)
+                syncopy.followed[fn] = std::move(f);
+            else
+                syncopy.followed.erase(fn);
+        }
+    }
+}
+
+/**
+ * Quick check: if the content on the server is the same, only mtime and mode are updated.
+ * Compared by whole file md5 sums, both sides keep them cached.
+ * Only files of the same size are checked, others are changed for sure.
+ */
+bool quickcheck(Syncopy &syncopy, const syncopy::Scheduler::Job &job)
+{
+    {
+        std::lock_guard<std::mutex> locker(syncopy.mutex);
+        auto it = syncopy.remote.find(job.path);
+        if (it == syncopy.remote.end() || it->second.size != job.size)
+            return false;
+    }
+
+    syncopy::File cur(job.path);
+    auto md5 = syncopy.hashes.md5(cur);
+    if (md5.empty() || md5 != syncopy.call("md5", job.path).as<std::string>())
+        return false;
+
+    std::cout << job.path << ": > same content, utime ..." << std::endl;
+    return syncopy.call("utime", job.path, job.mtime, cur.mode()).as<bool>();
+}
+
+void worker(Syncopy &syncopy, size_t id)
+{
+    syncopy::Trace::thread("worker " + std::to_string(id));
+    syncopy::Scheduler::Job job;
+    while (syncopy.scheduler.pop(id, job)) {
+        syncopy::Span span("sync", job.path, "worker");
+        syncopy.inflight.add(1);
+        if (syncopy.follow && syncopy.following(job.path))
+            std::cout << job.path << ": followed" << std::endl;
+        else if (append(syncopy, job))
+            std::cout << job.path << ": < appended" << std::endl;
+        else if (quickcheck(syncopy, job))
+            std::cout << job.path << ": < updated" << std::endl;
+        else if (upload(syncopy, job))
+            std::cout << job.path << ": < patched" << std::endl;
         else
-            std::cerr << fn << ": could not patch" << std::endl;
+            std::cerr << job.path << ": could not patch" << std::endl;
 
-        locker.lock();
-        syncopy.pending.erase(fn);
+        syncopy.inflight.add(-1);
+        syncopy.scheduler.done(job);
     }
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
-        std::cout << argv[0] << " SOURCE_DIR [HOST [PORT]]" << std::endl;
+    std::vector<std::string> args;
+    std::set<std::string> flags;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.substr(0, 2) == "--")
+            flags.insert(arg);
+        else
+            args.push_back(arg);
+    }
+
+    if (args.empty() || !syncopy::rpc::io(flags)) {
+        std::cout << argv[0] << " SOURCE_DIR [HOST [PORT]] [--follow] [--once] [--mmap] [--cache=keep|dontneed|direct] [--metrics=PATH] [--trace=PATH]" << std::endl;
         return 0;
     }
 
-    const std::string src_dir = argv[1];
-    const std::string host = argc > 2 ? argv[2] : "127.0.0.1";
-    const uint16_t port = argc > 3 ? std::stoi(argv[3]) : 4567;
+    const std::string src_dir = args[0];
+    const std::string host = args.size() > 1 ? args[1] : "127.0.0.1";
+    const uint16_t port = args.size() > 2 ? std::stoi(args[2]) : 4567;
 
     std::cout << "src dir : " << src_dir << std::endl;
     std::cout << "host    : " << host << std::endl;
     std::cout << "port    : " << port << std::endl;
     std::vector<std::thread> threads;
     Syncopy syncopy(host, port);
+    // Exits when the server has the same tree, like a one-shot rsync
+    const bool once = flags.count("--once") > 0;
+    syncopy.follow = flags.count("--follow") > 0 && !once;
+    bool converged = !once;
+    // Before changing the dir
+    const auto metrics = syncopy::rpc::absolute(syncopy::rpc::option(flags, "metrics"));
+    const auto trace = syncopy::rpc::absolute(syncopy::rpc::option(flags, "trace"));
+    if (!trace.empty()) {
+        syncopy::Trace::enable();
+        syncopy::Trace::process("client");
+        syncopy::Trace::thread("main");
+
+        // SIGUSR1 writes the trace, SIGINT and SIGTERM write it and exit
+        sigset_t sigs;
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGINT);
+        sigaddset(&sigs, SIGTERM);
+        sigaddset(&sigs, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+        std::thread([sigs, trace] {
+            int sig = 0;
+            while (sigwait(&sigs, &sig) == 0) {
+                syncopy::Trace::dump(trace);
+                if (sig != SIGUSR1)
+                    std::_Exit(EXIT_FAILURE);
+            }
+        }).detach();
+    }
     try {
         syncopy::File::chdir(src_dir);
-        for (int i = 0; i < 4; ++i)
-            threads.push_back(std::thread(worker, std::ref(syncopy)));
-
-        while (true) {
-            auto remote_dirs = syncopy.client.call("dirs").as<std::set<std::string>>();
-            auto local_dirs = syncopy::rpc::dirs(".");
+        if (!metrics.empty()) {
+            threads.push_back(std::thread(syncopy::rpc::dump, metrics, std::cref(syncopy.quit), [&syncopy] {
+                syncopy.queued.set(syncopy.scheduler.size());
+            }));
+        }
+        for (size_t i = 0; i < workers; ++i)
+            threads.push_back(std::thread(worker, std::ref(syncopy), i));
+        if (syncopy.follow)
+            threads.push_back(std::thread(follower, std::ref(syncopy)));
 
-            for (auto &d : remote_dirs) {
-                auto it = local_dirs.find(d);
-                if (it == local_dirs.end()) {
-                    std::cout << "> removing dir: " << d << " ...";
-                    syncopy.client.call("rmdir", d);
-                    std::cout << " < ok" << std::endl;
-                }
+        for (size_t pass = 0; !once || pass < once_passes; ++pass) {
+            // Calls and uploads made by this pass
+            size_t work = 0;
+            auto remote_dirs = syncopy.call("dirs").as<std::set<std::string>>();
+            std::map<std::string, syncopy::rpc::Stat> local_files;
+            std::set<std::string> local_dirs;
+            {
+                syncopy::Span span("scan");
+                syncopy::rpc::scan(".", local_files, local_dirs);
             }
 
             for (auto &d : local_dirs) {
                 auto it = remote_dirs.find(d);
                 if (it == remote_dirs.end()) {
+                    ++work;
                     std::cout << "> creating dir: " << d << " ...";
-                    syncopy.client.call("mkdir", d);
+                    syncopy.call("mkdir", d);
                     std::cout << " < ok" << std::endl;
                 }
             }
 
-            auto remote_files = syncopy.client.call("files").as<std::map<std::string, syncopy::rpc::Stat>>();
-            auto local_files = syncopy::rpc::files(".");
+            auto remote_files = syncopy.call("files").as<std::map<std::string, syncopy::rpc::Stat>>();
 
+            // Files removed locally
+            std::map<std::string, syncopy::rpc::Stat> vanished;
             for (auto &f : remote_files) {
-                auto it = local_files.find(f.first);
-                if (it == local_files.end()) {
-                    std::cout << "> removing file: " << f.first << " ...";
-                    syncopy.client.call("rmdir", f.first);
+                if (local_files.find(f.first) == local_files.end())
+                    vanished.insert(f);
+            }
+
+            // Files moved locally are renamed on the server instead of being uploaded again
+            std::map<std::string, std::string> vanished_md5;
+            for (auto &f : local_files) {
+                if (vanished.empty())
+                    break;
+                if (remote_files.find(f.first) != remote_files.end())
+                    continue;
+
+                auto from = renamed(syncopy, f.first, f.second, vanished, vanished_md5);
+                if (from.empty())
+                    continue;
+
+                ++work;
+                std::cout << "> renaming file: " << from << " -> " << f.first << " ...";
+                if (syncopy.call("rename", from, f.first).as<bool>()) {
+                    remote_files[f.first] = vanished[from];
+                    vanished.erase(from);
+                    std::cout << " < ok" << std::endl;
+                } else {
+                    std::cout << " < failed" << std::endl;
+                }
+            }
+
+            for (auto &f : vanished) {
+                ++work;
+                std::cout << "> removing file: " << f.first << " ...";
+                syncopy.call("rmdir", f.first);
+                syncopy.hashes.erase(f.first);
+                std::cout << " < ok" << std::endl;
+            }
+
+            // After the files, otherwise moved files would be removed with their old dirs
+            for (auto &d : remote_dirs) {
+                auto it = local_dirs.find(d);
+                if (it == local_dirs.end()) {
+                    ++work;
+                    std::cout << "> removing dir: " << d << " ...";
+                    syncopy.call("rmdir", d);
                     std::cout << " < ok" << std::endl;
                 }
             }
 
+            {
+                std::lock_guard<std::mutex> locker(syncopy.mutex);
+                syncopy.remote = remote_files;
+            }
+
             for (auto &f : local_files) {
                 syncopy::File locf(f.first);
                 if (locf.ext() == syncopy_ext)
@@ -131,27 +621,45 @@ int main(int argc, char *argv[])
                 // If mtime and name are the same
                 if (it != remote_files.end() && it->second == f.second)
                     continue;
+                // Streamed by the follower
+                if (syncopy.follow && syncopy.following(f.first))
+                    continue;
 
-                {
-                    std::lock_guard<std::mutex> locker(syncopy.mutex);
-                    auto it = syncopy.pending.find(f.first);
-                    // Add to pending only new files and not being processed
-                    if (it == syncopy.pending.end() || it->second != true)
-                        syncopy.pending[f.first] = false;
-                }
-                syncopy.cv.notify_all();
+                ++work;
+                syncopy.scheduler.push(f.first, f.second.size, f.second.mtime);
             }
 
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            if (!once) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+
+            // Scanned again right after the uploads, nothing to do means the trees are the same
+            while (syncopy.scheduler.size() > 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            if (work == 0) {
+                converged = true;
+                break;
+            }
         }
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
     }
 
     syncopy.quit = true;
-    syncopy.cv.notify_all();
+    syncopy.scheduler.stop();
     for (auto &t : threads)
         t.join();
 
-    return EXIT_SUCCESS;
+    if (once) {
+        for (auto &c : syncopy.calls)
+            std::cout << "rpc " << c.first << " " << c.second.first << std::endl;
+        if (!converged)
+            std::cerr << "not converged after " << once_passes << " passes" << std::endl;
+    }
+
+    if (!trace.empty())
+        syncopy::Trace::dump(trace);
+
+    return converged ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -7,22 +7,32 @@
 
 int main(int argc, char *argv[])
 {
-    if (argc < 3) {
-        std::cout << argv[0] << " SIGNATURE_FILE SOURCE_FILE" << std::endl;
+    std::vector<std::string> args;
+    bool segments = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--segments")
+            segments = true;
+        else
+            args.push_back(arg);
+    }
+
+    if (args.size() < 2) {
+        std::cout << argv[0] << " SIGNATURE_FILE SOURCE_FILE [--segments]" << std::endl;
         return 0;
     }
 
     syncopy::Signature sig;
-    if (!sig.load(argv[1])) {
-        std::cerr << "Could not recognize signature file: " << argv[1] << std::endl;
+    if (!sig.load(args[0])) {
+        std::cerr << "Could not recognize signature file: " << args[0] << std::endl;
         return EXIT_FAILURE;
     }
 
-    std::cout << "signature file : " << argv[1] << std::endl;
+    std::cout << "signature file : " << args[0] << std::endl;
     std::cout << "window         : " << sig.window << std::endl;
     std::cout << "chunks         : " << sig.chunks.size() << std::endl;
 
-    std::string fn = argv[2];
+    std::string fn = args[1];
     syncopy::File src(fn);
 
     if (!src.exists()) {
@@ -30,7 +40,7 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    auto delta = src.delta(sig);
+    auto delta = src.delta(syncopy::CompactSignature(sig), size_t(-1), {}, segments);
     auto fn_delta = fn + ".delta";
     delta.save(fn_delta);
 
@@ -0,0 +1,105 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <set>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <condition_variable>
+
+namespace syncopy
+{
+    namespace rpc
+    {
+        /**
+         * Table of locked paths.
+         * Calls on the same path are serialized while other paths proceed in parallel.
+         * A lock is not bound to a thread, so a session may keep it between calls.
+         *
+         * @example:
+         *  auto lock = locks.lock(path, std::chrono::seconds(1));
+         *  if (!lock)
+         *      return; // busy
+         */
+        class PathLocks
+        {
+        public:
+            using Lock = std::shared_ptr<const std::string>;
+
+            Lock lock(const std::string &path, std::chrono::milliseconds timeout)
+            {
+                std::unique_lock<std::mutex> locker(_mutex);
+                if (!_cv.wait_for(locker, timeout, [&] { return _locked.find(path) == _locked.end(); }))
+                    return nullptr;
+
+                _locked.insert(path);
+                return Lock(new std::string(path), [this] (const std::string *p) {
+                    {
+                        std::lock_guard<std::mutex> locker(_mutex);
+                        _locked.erase(*p);
+                    }
+                    _cv.notify_all();
+                    delete p;
+                });
+            }
+
+        private:
+            std::mutex _mutex;
+            std::condition_variable _cv;
+            std::set<std::string> _locked;
+        };
+
+        /**
+         * Limits the number of concurrent jobs.
+         */
+        class Semaphore
+        {
+        public:
+            explicit Semaphore(size_t count) : _count(count)
+            {
+            }
+
+            void acquire()
+            {
+                std::unique_lock<std::mutex> locker(_mutex);
+                _cv.wait(locker, [&] { return _count > 0; });
+                --_count;
+            }
+
+            void release()
+            {
+                {
+                    std::lock_guard<std::mutex> locker(_mutex);
+                    ++_count;
+                }
+                _cv.notify_one();
+            }
+
+        private:
+            std::mutex _mutex;
+            std::condition_variable _cv;
+            size_t _count;
+        };
+
+        class SemaphoreGuard
+        {
+        public:
+            explicit SemaphoreGuard(Semaphore &s) : _s(s)
+            {
+                _s.acquire();
+            }
+
+            ~SemaphoreGuard()
+            {
+                _s.release();
+            }
+
+        private:
+            Semaphore &_s;
+        };
+    }
+}
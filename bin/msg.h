@@ -5,22 +5,46 @@
 #pragma once
 
 #include "syncopy/file.h"
+#include "syncopy/reader.h"
+#include "syncopy/scanner.h"
+#include "syncopy/metrics.h"
+#include "syncopy/trace.h"
 #include "rpc/msgpack.hpp"
 #include <string>
 #include <vector>
 #include <set>
 #include <sstream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <climits>
+#include <unistd.h>
 
 namespace syncopy
 {
     namespace rpc
     {
+        // Window of signatures created by the server and of the block index
+        static const uint32_t WINDOW = 1000;
+        // Max number of signature chunks in one session_signature reply
+        static const size_t SIGNATURE_WINDOW = 1 << 16;
+        // Approximate size of one delta batch sent by session_append
+        static const size_t DELTA_BATCH = 1 << 20;
+
+        /**
+         * Metadata of a file filled by one statx call.
+         * Files are compared by size and mtime only.
+         */
         struct Stat
         {
             size_t size = 0;
             time_t mtime = {0};
+            long mtime_nsec = 0;
+            uint32_t mode = 0;
+            uint64_t inode = 0;
 
-            MSGPACK_DEFINE(size, mtime);
+            MSGPACK_DEFINE(size, mtime, mtime_nsec, mode, inode);
 
             bool operator==(const Stat &other)
             {
@@ -28,21 +52,61 @@ namespace syncopy
             }
         };
 
+        /**
+         * Reply to session_begin.
+         * Credit is the number of delta bytes the client is allowed to have in flight.
+         * Blocks is the size of the block index of the server, nothing is looked up in an empty one.
+         * Zero id means the session could not be started.
+         */
+        struct SessionInfo
+        {
+            uint64_t id = 0;
+            size_t credit = 0;
+            size_t blocks = 0;
+
+            MSGPACK_DEFINE(id, credit, blocks);
+        };
+
+        /**
+         * Block found by lookup: size bytes at pos of the file on the server.
+         * Empty path means not found.
+         */
+        struct Location
+        {
+            std::string path;
+            size_t pos = 0;
+            size_t size = 0;
+
+            MSGPACK_DEFINE(path, pos, size);
+        };
+
+        // Threads reading dirs of a tree
+        static const size_t SCAN_THREADS = 8;
+
+        // Files and dirs of a tree in one pass
+        static void scan(const std::string &dir, std::map<std::string, Stat> &files, std::set<std::string> &dirs)
+        {
+            for (auto &e : syncopy::Scanner(SCAN_THREADS).scan(dir)) {
+                if (e.dir())
+                    dirs.insert(std::move(e.path));
+                else
+                    files[std::move(e.path)] = {e.size, e.mtime, e.mtime_nsec, e.mode, e.inode};
+            }
+        }
+
         static std::map<std::string, Stat> files(const std::string &dir)
         {
             std::map<std::string, Stat> result;
-            for (auto &f : syncopy::File::files(dir))
-                result[f.path()] = {f.size(), f.mtime()};
-
+            std::set<std::string> dirs;
+            scan(dir, result, dirs);
             return result;
         }
 
         static std::set<std::string> dirs(const std::string &dir)
         {
+            std::map<std::string, Stat> files;
             std::set<std::string> result;
-            for (auto &f : syncopy::File::dirs(dir))
-                result.insert(f);
-
+            scan(dir, files, result);
             return result;
         }
 
@@ -74,6 +138,106 @@ namespace syncopy
             MSGPACK_DEFINE(data);
         };
 
+        /**
+         * Applies I/O flags shared by the client and the server, returns false on unknown values.
+         *
+         * @example:
+         *  io({"--mmap", "--cache=dontneed"});
+         */
+        static bool io(const std::set<std::string> &flags)
+        {
+            auto &opts = syncopy::Reader::options;
+            if (flags.count("--mmap"))
+                opts.backend = syncopy::Reader::Backend::Mmap;
+
+            for (auto &flag : flags) {
+                if (flag.substr(0, 8) != "--cache=")
+                    continue;
+
+                auto value = flag.substr(8);
+                if (value == "keep")
+                    opts.cache = syncopy::Reader::Cache::Keep;
+                else if (value == "dontneed")
+                    opts.cache = syncopy::Reader::Cache::DontNeed;
+                else if (value == "direct")
+                    opts.cache = syncopy::Reader::Cache::Direct;
+                else
+                    return false;
+            }
+
+            return true;
+        }
+
+        // Value of a --name=value flag, empty if not set
+        static std::string option(const std::set<std::string> &flags, const std::string &name)
+        {
+            auto prefix = "--" + name + "=";
+            for (auto &flag : flags) {
+                if (flag.compare(0, prefix.size(), prefix) == 0)
+                    return flag.substr(prefix.size());
+            }
+
+            return {};
+        }
+
+        // Relative paths are resolved by the current dir
+        static std::string absolute(const std::string &path)
+        {
+            char cwd[PATH_MAX];
+            if (path.empty() || path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+                return path;
+            return std::string(cwd) + "/" + path;
+        }
+
+        // How often metrics are written by --metrics=PATH
+        static const auto METRICS_PERIOD = std::chrono::seconds(10);
+
+        /**
+         * Writes metrics to a Prometheus text file every METRICS_PERIOD until stopped and once more at the end.
+         * `sample` updates gauges right before writing.
+         */
+        static void dump(const std::string &path, const std::atomic<bool> &stopped, const std::function<void()> &sample = {})
+        {
+            auto next = std::chrono::steady_clock::now();
+            while (true) {
+                bool last = stopped;
+                if (last || std::chrono::steady_clock::now() >= next) {
+                    if (sample)
+                        sample();
+                    Metrics::global().dump(path);
+                    next += METRICS_PERIOD;
+                }
+                if (last)
+                    break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        }
+
+        template<class F, class R, class... Args>
+        static auto timed(const std::string &name, Histogram &h, F f, R (F::*)(Args...) const)
+        {
+            return [&h, f, name] (Args... args) -> R {
+                Timer timer(h);
+                Span span(name, {}, "rpc");
+                return f(std::forward<Args>(args)...);
+            };
+        }
+
+        /**
+         * Handler of an rpc call which observes its time by `syncopy_rpc_seconds{method="name"}`
+         * and records it as a span of the trace.
+         * The arguments are the same, so rpclib binds it like the original one.
+         *
+         * @example:
+         *  srv.bind("md5", timed("md5", [] (const std::string &path) { ... }));
+         */
+        template<class F>
+        static auto timed(const std::string &name, F f)
+        {
+            auto &h = Metrics::global().histogram("syncopy_rpc_seconds", "Time to handle rpc calls", "method=\"" + name + "\"");
+            return timed(name, h, f, &F::operator());
+        }
+
         std::string escape(std::string path)
         {
             if (path.substr(0, 2) == "./")
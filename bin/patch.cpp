@@ -7,25 +7,35 @@
 
 int main(int argc, char *argv[])
 {
-    if (argc < 3) {
-        std::cout << argv[0] << " DELTA_FILE DESTINATION_FILE" << std::endl;
+    std::vector<std::string> args;
+    size_t threads = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.substr(0, 10) == "--threads=")
+            threads = std::stoul(arg.substr(10));
+        else
+            args.push_back(arg);
+    }
+
+    if (args.size() < 2) {
+        std::cout << argv[0] << " DELTA_FILE DESTINATION_FILE [--threads=N]" << std::endl;
         return 0;
     }
 
     syncopy::Delta delta;
-    if (!delta.load(argv[1])) {
-        std::cerr << "Could not recognize delta file: " << argv[1] << std::endl;
+    if (!delta.load(args[0])) {
+        std::cerr << "Could not recognize delta file: " << args[0] << std::endl;
         return EXIT_FAILURE;
     }
 
-    syncopy::File dst(argv[2]);
+    syncopy::File dst(args[1]);
 
     if (!dst.exists()) {
-        std::cerr << "Could not open destination file: " << argv[2] << std::endl;
+        std::cerr << "Could not open destination file: " << args[1] << std::endl;
         return EXIT_FAILURE;
     }
 
-    dst.patch(delta);
+    dst.patch(delta, threads);
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -3,69 +3,357 @@
  *********************************************************/
 
 #include "msg.h"
+#include "session.h"
+#include "locks.h"
+#include "hashcache.h"
+#include "index.h"
 #include "rpc/server.h"
 #include <fstream>
+#include <thread>
+#include <set>
+#include <signal.h>
+
+// Chunks may be copied from other files, keep them inside of the destination dir
+static syncopy::Delta unpack(const syncopy::rpc::Msg<syncopy::Delta> &msg)
+{
+    auto delta = msg.unpack();
+    for (auto &chunk : delta.chunks) {
+        if (!chunk.path.empty())
+            chunk.path = syncopy::rpc::escape(chunk.path);
+    }
+
+    return delta;
+}
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
-        std::cout << argv[0] << " DESTINATION_DIR [HOST [PORT]]" << std::endl;
+    std::vector<std::string> args;
+    std::set<std::string> flags;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.substr(0, 2) == "--")
+            flags.insert(arg);
+        else
+            args.push_back(arg);
+    }
+
+    if (args.empty() || !syncopy::rpc::io(flags)) {
+        std::cout << argv[0] << " DESTINATION_DIR [HOST [PORT [THREADS]]] [--mmap] [--cache=keep|dontneed|direct] [--metrics=PATH] [--trace=PATH]" << std::endl;
         return 0;
     }
 
-    const std::string dst_dir = argv[1];
-    const std::string host = argc > 2 ? argv[2] : "127.0.0.1";
-    const uint16_t port = argc > 3 ? std::stoi(argv[3]) : 4567;
+    const std::string dst_dir = args[0];
+    const std::string host = args.size() > 1 ? args[1] : "127.0.0.1";
+    const uint16_t port = args.size() > 2 ? std::stoi(args[2]) : 4567;
+    const size_t threads = args.size() > 3 ? std::stoi(args[3]) : std::max(2u, std::thread::hardware_concurrency());
 
     std::cout << "dst dir : " << dst_dir << std::endl;
     std::cout << "host    : " << host << std::endl;
     std::cout << "port    : " << port << std::endl;
+    std::cout << "threads : " << threads << std::endl;
+    // Before changing the dir
+    const auto metrics = syncopy::rpc::absolute(syncopy::rpc::option(flags, "metrics"));
+    const auto trace = syncopy::rpc::absolute(syncopy::rpc::option(flags, "trace"));
+    if (!trace.empty()) {
+        syncopy::Trace::enable();
+        syncopy::Trace::process("server");
+    }
+
+    // Handled by sigwait() in the main thread, workers must not receive them
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    // Writes the trace without stopping
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+
     try {
         syncopy::File::chdir(dst_dir);
         rpc::server srv(host, port);
+        // Every call is timed by syncopy_rpc_seconds
+        auto bind = [&srv] (const std::string &name, auto f) {
+            srv.bind(name, syncopy::rpc::timed(name, f));
+        };
+        // Memory shared by all sessions for delta batches in flight
+        syncopy::rpc::Sessions sessions(256 << 20);
+        syncopy::rpc::PathLocks locks;
+        syncopy::HashCache hashes;
+        // Signatures read and hash whole files, do not let them occupy all workers
+        syncopy::rpc::Semaphore signatures(std::max<size_t>(1, threads / 2));
+        // Blocks of all files, built in background and updated by patches
+        syncopy::Index index(syncopy::rpc::WINDOW);
+        std::atomic<bool> stopped = {false};
+        std::thread indexer([&] {
+            syncopy::Trace::thread("indexer");
+            try {
+                for (auto &entry : syncopy::rpc::files(".")) {
+                    if (stopped)
+                        break;
+                    syncopy::File f(entry.first);
+                    // Busy files are indexed when patched
+                    auto lock = locks.lock(f.path(), std::chrono::milliseconds(0));
+                    if (!lock)
+                        continue;
+                    syncopy::rpc::SemaphoreGuard guard(signatures);
+                    index.add(f.path(), f.compactSignature(index.window));
+                }
+                std::cout << "indexed blocks: " << index.size() << std::endl;
+            } catch (const std::exception &e) {
+                std::cerr << "Could not index: " << e.what() << std::endl;
+            }
+        });
+
+        // Sessions of crashed clients must not keep their paths locked until another session begins
+        std::thread expirer([&] {
+            syncopy::Trace::thread("expirer");
+            while (!stopped) {
+                sessions.expire();
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+        });
 
-        srv.bind("dirs", [] { return syncopy::rpc::dirs("."); });
-        srv.bind("mkdir", [] (const std::string &d) {
+        bind("dirs", [] { return syncopy::rpc::dirs("."); });
+        bind("mkdir", [] (const std::string &d) {
             auto dir = syncopy::rpc::escape(d);
             if (dir.empty())
                 return;
             std::cout << "mkdir: " << dir << std::endl;
             syncopy::File::mkdir(dir);
         });
-        srv.bind("rmdir", [] (const std::string &d) {
+        bind("rmdir", [&locks, &hashes, &index] (const std::string &d) {
             auto dir = syncopy::rpc::escape(d);
             if (dir.empty())
                 return;
+            auto lock = locks.lock(dir, std::chrono::seconds(30));
+            if (!lock) {
+                std::cerr << "Path is busy: " << dir << std::endl;
+                return;
+            }
             std::cout << "rmdir: " << dir << std::endl;
             syncopy::File::rmdir(dir);
+            hashes.erase(dir);
+            index.remove(dir);
+        });
+        bind("files", [] { return syncopy::rpc::files("."); });
+        bind("md5", [&locks, &hashes, &signatures] (const std::string &p) {
+            auto path = syncopy::rpc::escape(p);
+            if (path.empty())
+                return std::string{};
+            auto lock = locks.lock(path, std::chrono::seconds(30));
+            if (!lock)
+                return std::string{};
+            syncopy::rpc::SemaphoreGuard guard(signatures);
+            return hashes.md5(syncopy::File(path));
+        });
+        bind("utime", [&locks, &hashes] (const std::string &p, time_t mtime, mode_t mode) {
+            auto path = syncopy::rpc::escape(p);
+            if (path.empty())
+                return false;
+            auto lock = locks.lock(path, std::chrono::seconds(30));
+            syncopy::File f(path);
+            if (!lock || !f.exists())
+                return false;
+            std::cout << "utime: " << path << std::endl;
+            std::string md5;
+            bool cached = hashes.find(path, f.size(), f.mtime(), md5);
+            f.touch(mtime);
+            f.chmod(mode);
+            // The content is the same
+            if (cached)
+                hashes.set(path, f.size(), f.mtime(), md5);
+            return true;
+        });
+        bind("append", [&locks] (const std::string &p, size_t offset, const std::string &md5,
+            const std::vector<uint8_t> &data, time_t mtime, mode_t mode) {
+            auto path = syncopy::rpc::escape(p);
+            if (path.empty())
+                return false;
+            auto lock = locks.lock(path, std::chrono::seconds(30));
+            syncopy::File f(path);
+            if (!lock || !f.exists() || f.size() != offset)
+                return false;
+            // The file must be a prefix of the source, its last block is compared
+            size_t len = std::min<size_t>(syncopy::rpc::WINDOW, offset);
+            auto block = f.read(offset - len, len);
+            if (syncopy::checksum::md5(block.data(), block.size()) != md5) {
+                std::cout << "append: " << path << " is not a prefix" << std::endl;
+                return false;
+            }
+            std::cout << "append: " << path << " " << data.size() << " bytes" << std::endl;
+            f.append(data);
+            f.touch(mtime);
+            f.chmod(mode);
+            return f.size() == offset + data.size();
+        });
+        bind("rename", [&locks, &hashes, &index] (const std::string &f, const std::string &t) {
+            auto from = syncopy::rpc::escape(f);
+            auto to = syncopy::rpc::escape(t);
+            if (from.empty() || to.empty() || from == to)
+                return false;
+            // Always in the same order to avoid deadlocks
+            auto lock1 = locks.lock(std::min(from, to), std::chrono::seconds(30));
+            auto lock2 = locks.lock(std::max(from, to), std::chrono::seconds(30));
+            syncopy::File file(from);
+            if (!lock1 || !lock2 || !file.exists())
+                return false;
+            std::cout << "rename: " << from << " -> " << to << std::endl;
+            syncopy::File::mkdir(syncopy::File(to).parent_path());
+            file.rename(to);
+            hashes.rename(from, to);
+            index.rename(from, to);
+            return syncopy::File(to).exists();
         });
-        srv.bind("files", [] { return syncopy::rpc::files("."); });
-        srv.bind("signature", [] (const std::string &p) {
+        bind("signature", [&locks, &signatures] (const std::string &p) {
             auto path = syncopy::rpc::escape(p);
             if (path.empty())
                 return syncopy::rpc::Msg<syncopy::Signature>{};
+            auto lock = locks.lock(path, std::chrono::seconds(30));
+            if (!lock) {
+                std::cerr << "Path is busy: " << path << std::endl;
+                return syncopy::rpc::Msg<syncopy::Signature>{};
+            }
             std::cout << "signature: " << path << std::endl;
+            syncopy::rpc::SemaphoreGuard guard(signatures);
             syncopy::File f(path);
             return syncopy::rpc::Msg<syncopy::Signature>(f.signature());
         });
-        srv.bind("patch", [] (const std::string &p, const syncopy::rpc::Msg<syncopy::Delta> &msg) {
+        bind("patch", [&locks, &hashes, &index] (const std::string &p, const syncopy::rpc::Msg<syncopy::Delta> &msg) {
             bool result = true;
             auto path = syncopy::rpc::escape(p);
             if (path.empty())
                 return false;
+            auto lock = locks.lock(path, std::chrono::seconds(30));
+            if (!lock) {
+                std::cerr << "Path is busy: " << path << std::endl;
+                return false;
+            }
             std::cout << "patch: " << path << std::endl;
             syncopy::File dst(path);
             if (!dst.exists())
                 dst.write({});
-            auto delta = msg.unpack();
-            if (!dst.patch(delta)) {
+            auto delta = unpack(msg);
+            // Blocks are hashed while written, the index does not read the file again
+            syncopy::Patcher patcher(dst.path());
+            patcher.sign(index.window);
+            result = patcher.ok();
+            for (auto &chunk : delta.chunks)
+                result = result && patcher.apply(chunk);
+            if (!result || !patcher.commit(delta.md5, delta.st)) {
                 std::cerr << "Could not patch: " << dst.path() << std::endl;
                 result = false;
+            } else {
+                hashes.set(dst.path(), dst.size(), dst.mtime(), delta.md5);
+                index.add(dst.path(), patcher.signature());
             }
             return result;
         });
+        bind("session_begin", [&sessions, &locks, &index] (const std::string &p, size_t size) {
+            auto path = syncopy::rpc::escape(p);
+            if (path.empty())
+                return syncopy::rpc::SessionInfo{};
+            // Kept by the session until commit or abort, the client retries later if busy
+            auto lock = locks.lock(path, std::chrono::seconds(1));
+            if (!lock) {
+                std::cerr << "Path is busy: " << path << std::endl;
+                return syncopy::rpc::SessionInfo{};
+            }
+            syncopy::File dst(path);
+            std::string basis;
+            syncopy::rpc::PathLocks::Lock basis_lock;
+            if (!dst.exists()) {
+                basis = dst.fuzzy(size);
+                // A busy basis is not waited for, the file is uploaded without it
+                if (!basis.empty())
+                    basis_lock = locks.lock(basis, std::chrono::milliseconds(0));
+                if (!basis_lock)
+                    basis.clear();
+                if (basis.empty())
+                    dst.write({});
+                else
+                    syncopy::File::mkdir(dst.parent_path());
+            }
+            auto id = sessions.begin(path, lock, basis, basis_lock);
+            if (!id) {
+                std::cerr << "Could not begin session: " << path << std::endl;
+                return syncopy::rpc::SessionInfo{};
+            }
+            std::cout << "begin: " << path << " session: " << id;
+            if (!basis.empty())
+                std::cout << " basis: " << basis;
+            std::cout << std::endl;
+            return syncopy::rpc::SessionInfo{id, sessions.credit(id), index.size()};
+        });
+        bind("session_signature", [&sessions, &signatures] (uint64_t id, size_t offset, size_t count) {
+            auto session = sessions.find(id);
+            if (!session)
+                return syncopy::rpc::Msg<syncopy::CompactSignature>{};
+            syncopy::rpc::SemaphoreGuard guard(signatures);
+            count = std::min(count, syncopy::rpc::SIGNATURE_WINDOW);
+            return syncopy::rpc::Msg<syncopy::CompactSignature>(session->signature(offset, count));
+        });
+        bind("session_append", [&sessions] (uint64_t id, uint64_t seq, const syncopy::rpc::Msg<syncopy::Delta> &msg) {
+            auto session = sessions.find(id);
+            if (!session || !session->append(seq, unpack(msg))) {
+                std::cerr << "Could not append to session: " << id << std::endl;
+                return size_t(0);
+            }
+            return sessions.credit(id);
+        });
+        bind("session_commit", [&sessions, &hashes, &index] (uint64_t id, const syncopy::rpc::Msg<syncopy::Delta> &msg) {
+            auto session = sessions.find(id);
+            if (!session)
+                return false;
+            sessions.end(id);
+            std::cout << "commit: " << session->path << " session: " << id << std::endl;
+            auto delta = unpack(msg);
+            if (!session->commit(delta)) {
+                std::cerr << "Could not patch: " << session->path << std::endl;
+                return false;
+            }
+            syncopy::File dst(session->path);
+            hashes.set(dst.path(), dst.size(), dst.mtime(), delta.md5);
+            index.add(dst.path(), session->patched());
+            return true;
+        });
+        bind("session_abort", [&sessions] (uint64_t id) {
+            std::cout << "abort session: " << id << std::endl;
+            sessions.end(id);
+        });
+
+        bind("stats", [] { return syncopy::Metrics::global().snapshot(); });
+
+        bind("lookup", [&index] (const std::vector<std::string> &md5s) {
+            std::vector<syncopy::rpc::Location> result(md5s.size());
+            syncopy::Index::Location loc;
+            for (size_t i = 0; i < md5s.size(); ++i) {
+                if (index.find(md5s[i], loc))
+                    result[i] = {loc.path, loc.pos, loc.size};
+            }
+            return result;
+        });
+
+        std::thread dumper;
+        if (!metrics.empty()) {
+            dumper = std::thread(syncopy::rpc::dump, metrics, std::cref(stopped), std::function<void()>{});
+        }
+
+        srv.async_run(threads);
 
-        srv.run();
+        int sig = 0;
+        while (sigwait(&sigs, &sig) == 0 && sig == SIGUSR1) {
+            if (!trace.empty())
+                syncopy::Trace::dump(trace);
+        }
+        std::cout << "stopping ..." << std::endl;
+        srv.stop();
+        stopped = true;
+        indexer.join();
+        expirer.join();
+        if (dumper.joinable())
+            dumper.join();
+        if (!trace.empty())
+            syncopy::Trace::dump(trace);
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
         return EXIT_FAILURE;
@@ -0,0 +1,224 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include "msg.h"
+#include "locks.h"
+#include <map>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+
+namespace syncopy
+{
+    namespace rpc
+    {
+        /**
+         * Chunked upload of one file: begin -> append... -> commit or abort.
+         * A new file is patched using an existing similar file as a basis,
+         * which stays locked with the path, so it is not changed while it is signed and copied from.
+         * Delta batches are applied in order of their sequence numbers,
+         * batches which arrived too early are kept until the gap is filled.
+         */
+        class Session
+        {
+        public:
+            Session(const std::string &path, const PathLocks::Lock &lock, const std::string &basis,
+                    const PathLocks::Lock &basis_lock)
+                : path(path), basis(basis), _lock(lock), _basis_lock(basis_lock), _patcher(path, basis)
+            {
+                _patcher.sign(window);
+                touch();
+            }
+
+            bool ok() const { return _patcher.ok(); }
+
+            // Every call keeps the session from expiring, also while a part is being signed
+            CompactSignature signature(size_t offset, size_t count)
+            {
+                touch();
+                auto result = File(basis.empty() ? path : basis).compactSignature(window, offset, count);
+                touch();
+                return result;
+            }
+
+            bool append(uint64_t seq, Delta &&delta)
+            {
+                std::lock_guard<std::mutex> locker(_mutex);
+                touch();
+                if (seq < _next || _failed)
+                    return false;
+
+                _pending.emplace(seq, std::move(delta));
+                for (auto it = _pending.begin(); it != _pending.end() && it->first == _next; it = _pending.erase(it)) {
+                    for (auto &chunk : it->second.chunks) {
+                        if (!_patcher.apply(chunk)) {
+                            _failed = true;
+                            return false;
+                        }
+                    }
+                    ++_next;
+                }
+
+                return true;
+            }
+
+            bool commit(const Delta &delta)
+            {
+                std::lock_guard<std::mutex> locker(_mutex);
+                touch();
+                if (_failed || !_pending.empty())
+                    return false;
+
+                for (auto &chunk : delta.chunks) {
+                    if (!_patcher.apply(chunk))
+                        return false;
+                }
+
+                return _patcher.commit(delta.md5, delta.st);
+            }
+
+            // Signature of the patched file
+            const Signature &patched() const
+            {
+                return _patcher.signature();
+            }
+
+            std::chrono::steady_clock::duration idle() const
+            {
+                return std::chrono::steady_clock::now() - _touched.load();
+            }
+
+            // Bytes of batches the client may have sent but not acknowledged, reserved by Sessions
+            size_t credit() const { return _credit; }
+            void credit(size_t bytes) { _credit = bytes; }
+
+            const std::string path;
+            const std::string basis;
+            const uint32_t window = WINDOW;
+
+        private:
+            void touch()
+            {
+                _touched = std::chrono::steady_clock::now();
+            }
+
+            PathLocks::Lock _lock;
+            PathLocks::Lock _basis_lock;
+            Patcher _patcher;
+            std::mutex _mutex;
+            std::map<uint64_t, Delta> _pending;
+            uint64_t _next = 0;
+            bool _failed = false;
+            std::atomic<std::chrono::steady_clock::time_point> _touched;
+            std::atomic<size_t> _credit = {0};
+        };
+
+        /**
+         * Sessions opened by clients.
+         * The memory budget is shared between open sessions and granted to the clients as credits.
+         * A credit is reserved from the budget until the session ends, so credits never sum up to more
+         * than the budget: a session gets an equal share at most, and a new session is refused
+         * while less than a batch is left.
+         * A credit shrunk to give others their share takes effect after batches already sent under the old one.
+         */
+        class Sessions
+        {
+        public:
+            explicit Sessions(size_t budget) : _budget(std::max(budget, DELTA_BATCH))
+            {
+            }
+
+            // Returns 0 if the file could not be opened or the budget is used up
+            uint64_t begin(const std::string &path, const PathLocks::Lock &lock, const std::string &basis = {},
+                           const PathLocks::Lock &basis_lock = {})
+            {
+                auto session = std::make_shared<Session>(path, lock, basis, basis_lock);
+                if (!session->ok())
+                    return 0;
+
+                std::lock_guard<std::mutex> locker(_mutex);
+                if (_budget - _granted < DELTA_BATCH)
+                    return 0;
+
+                _sessions[++_id] = session;
+                grant(*session);
+                _open.set(_sessions.size());
+                return _id;
+            }
+
+            std::shared_ptr<Session> find(uint64_t id) const
+            {
+                std::lock_guard<std::mutex> locker(_mutex);
+                auto it = _sessions.find(id);
+                return it != _sessions.end() ? it->second : nullptr;
+            }
+
+            // Returns the credit of the session to the budget
+            void end(uint64_t id)
+            {
+                std::lock_guard<std::mutex> locker(_mutex);
+                auto it = _sessions.find(id);
+                if (it != _sessions.end())
+                    drop(it);
+            }
+
+            // Credit of the session for its next batches, 0 if there is no such session
+            size_t credit(uint64_t id)
+            {
+                std::lock_guard<std::mutex> locker(_mutex);
+                auto it = _sessions.find(id);
+                if (it == _sessions.end())
+                    return 0;
+
+                grant(*it->second);
+                return it->second->credit();
+            }
+
+            // Drops sessions abandoned by clients, their paths are unlocked and credits returned
+            void expire()
+            {
+                std::lock_guard<std::mutex> locker(_mutex);
+                for (auto it = _sessions.begin(); it != _sessions.end();) {
+                    if (it->second->idle() > std::chrono::minutes(10))
+                        drop(it);
+                    else
+                        ++it;
+                }
+            }
+
+        private:
+            // Gives the session its share of the budget out of what other sessions do not hold.
+            // Every session holds a batch at least, so the credit never drops below a batch.
+            void grant(Session &session)
+            {
+                size_t held = session.credit();
+                size_t share = std::max(DELTA_BATCH, _budget / _sessions.size());
+                size_t credit = std::min(share, _budget - (_granted - held));
+                _granted = _granted - held + credit;
+                session.credit(credit);
+                _credits.set(_granted);
+            }
+
+            void drop(std::map<uint64_t, std::shared_ptr<Session>>::iterator &it)
+            {
+                _granted -= it->second->credit();
+                _credits.set(_granted);
+                it = _sessions.erase(it);
+                _open.set(_sessions.size());
+            }
+
+            const size_t _budget;
+            size_t _granted = 0;
+            mutable std::mutex _mutex;
+            std::map<uint64_t, std::shared_ptr<Session>> _sessions;
+            uint64_t _id = 0;
+            Gauge &_open = Metrics::global().gauge("syncopy_sessions", "Files being uploaded to the server");
+            Gauge &_credits = Metrics::global().gauge("syncopy_sessions_credit_bytes", "Bytes of the budget granted to sessions");
+        };
+    }
+}
@@ -0,0 +1,91 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+namespace syncopy
+{
+    /**
+     * Append only storage of bytes in big segments.
+     * Segments are never moved, so returned pointers stay valid until clear() or destruction,
+     * also when the arena itself is moved.
+     *
+     * @example:
+     *  Arena arena;
+     *  const uint8_t *p = arena.append(data, size);
+     */
+    class Arena
+    {
+    public:
+        explicit Arena(size_t segment = 1 << 20) : _segment(segment) {}
+
+        Arena(Arena &&) = default;
+        Arena &operator=(Arena &&) = default;
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        // Returns size bytes which are not initialized
+        uint8_t *allocate(size_t size)
+        {
+            if (_segments.empty() || _segments.back().size - _segments.back().used < size) {
+                size_t n = std::max(_segment, size);
+                _segments.push_back({std::unique_ptr<uint8_t[]>(new uint8_t[n]), n, 0});
+            }
+
+            return take(size);
+        }
+
+        const uint8_t *append(const uint8_t *data, size_t size)
+        {
+            if (size == 0)
+                return nullptr;
+            auto ptr = allocate(size);
+            memcpy(ptr, data, size);
+            return ptr;
+        }
+
+        // Keeps the first segment, so new ones are not allocated for every delta batch
+        void clear()
+        {
+            if (_segments.size() > 1)
+                _segments.resize(1);
+            if (!_segments.empty())
+                _segments[0].used = 0;
+        }
+
+        // Bytes allocated by all segments
+        size_t capacity() const
+        {
+            size_t result = 0;
+            for (auto &s : _segments)
+                result += s.size;
+            return result;
+        }
+
+    private:
+        struct Segment
+        {
+            std::unique_ptr<uint8_t[]> data;
+            size_t size;
+            size_t used;
+        };
+
+        uint8_t *take(size_t size)
+        {
+            auto &s = _segments.back();
+            auto ptr = s.data.get() + s.used;
+            s.used += size;
+            return ptr;
+        }
+
+        size_t _segment;
+        std::vector<Segment> _segments;
+    };
+}
@@ -9,18 +9,86 @@
 #include <sstream>
 #include <iomanip>
 #include <iostream>
+#include <algorithm>
+#include <type_traits>
 
 namespace syncopy
 {
     namespace checksum
     {
-        class Adler32
+        inline std::string md5(const uint8_t *data, size_t len)
+        {
+            uint8_t result[MD5_DIGEST_LENGTH];
+            MD5(data, len, result);
+            std::ostringstream sout;
+            sout << std::hex << std::setfill('0');
+            for (int i = 0; i < MD5_DIGEST_LENGTH; ++i)
+                sout << std::setw(2) << int(result[i]);
+
+            return sout.str();
+        }
+
+        // Hex string of a binary digest
+        inline std::string hex(const uint8_t *digest, size_t len = MD5_DIGEST_LENGTH)
+        {
+            static const char digits[] = "0123456789abcdef";
+            std::string result(len * 2, '0');
+            for (size_t i = 0; i < len; ++i) {
+                result[i * 2] = digits[digest[i] >> 4];
+                result[i * 2 + 1] = digits[digest[i] & 0xf];
+            }
+
+            return result;
+        }
+
+        // Binary digest of a hex string, false if it is not a digest of len bytes
+        inline bool unhex(const std::string &str, uint8_t *digest, size_t len = MD5_DIGEST_LENGTH)
+        {
+            if (str.size() != len * 2)
+                return false;
+
+            auto value = [] (char c) {
+                return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            };
+            for (size_t i = 0; i < len; ++i) {
+                int hi = value(str[i * 2]);
+                int lo = value(str[i * 2 + 1]);
+                if (hi < 0 || lo < 0)
+                    return false;
+                digest[i] = hi << 4 | lo;
+            }
+
+            return true;
+        }
+
+        /**
+         * Rolling Adler32 of a window.
+         * The window is a template argument for common sizes, so the compiler replaces
+         * the multiply and modulo by it with constants; 0 means the window is given at runtime.
+         *
+         * @example:
+         *  BasicAdler32<1024> fixed;
+         *  Adler32 any(1000);
+         */
+        template<uint32_t W>
+        class BasicAdler32
         {
         public:
-            explicit Adler32(uint32_t window) : _window(window)
+            template<uint32_t V = W, typename std::enable_if<V != 0, int>::type = 0>
+            BasicAdler32()
+            {
+            }
+
+            template<uint32_t V = W, typename std::enable_if<V == 0, int>::type = 0>
+            explicit BasicAdler32(uint32_t window) : _window(window), _wmod(window % _base)
             {
             }
 
+            constexpr uint32_t window() const
+            {
+                return W ? W : _window;
+            }
+
             void eat(uint8_t in)
             {
                 _sum1 = (_sum1 + in) % _base;
@@ -29,21 +97,34 @@ namespace syncopy
                 _hash = (_sum2 << 16) | _sum1;
             }
 
-            void update(uint8_t in, uint8_t out)
+            // Same as eating bytes one by one, sums are reduced once per NMAX bytes like zlib does
+            void eat(const uint8_t *data, size_t size)
             {
-                int sum2 = (_hash >> 16) & 0xffff;
-                int sum1 = _hash & 0xffff;
+                while (size > 0) {
+                    size_t n = std::min(size, NMAX);
+                    size -= n;
+                    for (; n > 0; --n) {
+                        _sum1 += *data++;
+                        _sum2 += _sum1;
+                    }
+                    _sum1 %= _base;
+                    _sum2 %= _base;
+                }
 
-                sum1 += in - out;
-                if (sum1 >= _base)
-                    sum1 -= _base;
-                else if (sum1 < 0)
-                    sum1 += _base;
+                _hash = (_sum2 << 16) | _sum1;
+            }
+
+            void update(uint8_t in, uint8_t out)
+            {
+                // Multiples of the base keep both sums positive without signed arithmetic
+                _sum1 += in + _base - out;
+                if (_sum1 >= _base)
+                    _sum1 -= _base;
+                if (_sum1 >= _base)
+                    _sum1 -= _base;
 
-                sum2 = ((int)(sum2 - _window * out + sum1 - 1) % (int)_base);
-                if (sum2 < 0)
-                    sum2 += _base;
-                _hash = (sum2 << 16) | sum1;
+                _sum2 = (_sum2 + _sum1 + _base * 256 - 1 - wmod() * out) % _base;
+                _hash = (_sum2 << 16) | _sum1;
             }
 
             constexpr uint32_t hash() const
@@ -59,11 +140,125 @@ namespace syncopy
             }
 
         private:
-            uint32_t _window = 1;
+            // Max bytes summed before sum2 may overflow
+            static const size_t NMAX = 5552;
+
+            constexpr uint32_t wmod() const
+            {
+                return W ? W % _base : _wmod;
+            }
+
+            uint32_t _window = W;
+            uint32_t _wmod = W % _base;
             uint32_t _sum1 = 1;
             uint32_t _sum2 = 0;
             uint32_t _hash = 0;
             static const uint32_t _base = 65521;
         };
+
+        using Adler32 = BasicAdler32<0>;
+
+        /**
+         * Rolling 64 bit hash of a window: Adler32 in the high half and a polynomial hash modulo 2^64
+         * in the low half. Adler32 of short windows uses a small part of its range,
+         * so many windows share it; the polynomial part mixes every byte into all of its high bits.
+         *
+         * @example:
+         *  BasicRolling64<1024> fixed;
+         *  Rolling64 any(1000);
+         *  any.eat(data, 1000);
+         *  any.update(data[1000], data[0]);
+         */
+        template<uint32_t W>
+        class BasicRolling64
+        {
+        public:
+            template<uint32_t V = W, typename std::enable_if<V != 0, int>::type = 0>
+            BasicRolling64()
+            {
+            }
+
+            template<uint32_t V = W, typename std::enable_if<V == 0, int>::type = 0>
+            explicit BasicRolling64(uint32_t window) : _adler(window), _outer(power(window))
+            {
+            }
+
+            constexpr uint32_t window() const
+            {
+                return _adler.window();
+            }
+
+            void eat(uint8_t in)
+            {
+                _adler.eat(in);
+                _poly = _poly * MUL + in;
+            }
+
+            void eat(const uint8_t *data, size_t size)
+            {
+                _adler.eat(data, size);
+                // Four bytes per step shorten the chain of dependent multiplies
+                static constexpr uint64_t M2 = MUL * MUL;
+                static constexpr uint64_t M3 = M2 * MUL;
+                static constexpr uint64_t M4 = M3 * MUL;
+                size_t i = 0;
+                for (; i + 4 <= size; i += 4)
+                    _poly = _poly * M4 + data[i] * M3 + data[i + 1] * M2 + data[i + 2] * MUL + data[i + 3];
+                for (; i < size; ++i)
+                    _poly = _poly * MUL + data[i];
+            }
+
+            void update(uint8_t in, uint8_t out)
+            {
+                _adler.update(in, out);
+                _poly = _poly * MUL + in - out * outer();
+            }
+
+            constexpr uint64_t hash() const
+            {
+                return uint64_t(_adler.hash()) << 32 | _poly >> 32;
+            }
+
+            constexpr uint32_t adler32() const
+            {
+                return _adler.hash();
+            }
+
+            void reset()
+            {
+                _adler.reset();
+                _poly = 0;
+            }
+
+        private:
+            // Odd, so every byte changes the high bits
+            static constexpr uint64_t MUL = 0x9e3779b97f4a7c15ull;
+
+            // MUL^window, the weight of the byte leaving the window
+            static constexpr uint64_t power(uint32_t window)
+            {
+                uint64_t result = 1;
+                uint64_t base = MUL;
+                for (; window > 0; window >>= 1) {
+                    if (window & 1)
+                        result *= base;
+                    base *= base;
+                }
+
+                return result;
+            }
+
+            constexpr uint64_t outer() const
+            {
+                constexpr uint64_t fixed = power(W);
+                return W ? fixed : _outer;
+            }
+
+            BasicAdler32<W> _adler;
+            uint64_t _poly = 0;
+            uint64_t _outer = power(W);
+        };
+
+        using Rolling64 = BasicRolling64<0>;
     }
 }
\ No newline at end of file
@@ -0,0 +1,281 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include "signature.h"
+#include <cstring>
+
+static const std::string COMPACT_SIGNATURE_HEADER = "syncopy::compact";
+
+namespace syncopy
+{
+    /**
+     * Signature stored as parallel arrays: rolling hashes and binary md5 digests in one allocation,
+     * about 20 bytes per block instead of a Chunk with a heap allocated hex string.
+     * Positions and sizes are implicit while blocks follow each other by window,
+     * only signatures with holes keep them explicitly.
+     * Rolling64 signatures also keep the polynomial half of the 64 bit rolling hash of every block
+     * in the same allocation, a delta looks blocks up by the whole key so md5 is computed
+     * for far fewer false candidates.
+     *
+     * @example:
+     *  CompactSignature sig = file.compactSignature(1000);
+     *  for (size_t i = 0; i < sig.size(); ++i)
+     *      std::cout << sig.pos(i) << " " << sig.adler32(i) << std::endl;
+     */
+    class CompactSignature
+    {
+    public:
+        static const size_t DIGEST = MD5_DIGEST_LENGTH;
+
+        // Rolling hash of blocks, a delta rolls the same one
+        enum class Hash : uint8_t
+        {
+            Adler32,
+            Rolling64
+        };
+
+        CompactSignature() = default;
+
+        explicit CompactSignature(const Signature &sig) : window(sig.window), holes(sig.holes)
+        {
+            reserve(sig.chunks.size());
+            uint8_t d[DIGEST] = {};
+            for (auto &c : sig.chunks) {
+                if (!checksum::unhex(c.md5, d))
+                    memset(d, 0, sizeof(d));
+                push(c.pos, c.size, c.adler32, d);
+            }
+        }
+
+        Signature expand() const
+        {
+            Signature result;
+            result.window = window;
+            result.holes = holes;
+            result.chunks.reserve(_count);
+            for (size_t i = 0; i < _count; ++i)
+                result.chunks.emplace_back(pos(i), length(i), adler32(i), checksum::hex(digest(i)));
+
+            return result;
+        }
+
+        size_t size() const { return _count; }
+        bool empty() const { return _count == 0; }
+
+        size_t pos(size_t i) const { return _pos.empty() ? _offset + i * window : _pos[i]; }
+        size_t length(size_t i) const { return !_len.empty() ? _len[i] : i + 1 == _count ? _last : window; }
+        uint32_t adler32(size_t i) const { return hashes()[i]; }
+        // Adler32 in the high half, the polynomial half of Rolling64 or 0 in the low one
+        uint64_t key(size_t i) const { return uint64_t(adler32(i)) << 32 | (_wide ? hashes()[_cap + i] : 0); }
+        const uint8_t *digest(size_t i) const { return _buf.data() + digests() + i * DIGEST; }
+
+        // Position after the last block
+        size_t end() const { return _count > 0 ? pos(_count - 1) + length(_count - 1) : _offset; }
+
+        void push(size_t pos, size_t size, uint32_t adler32, const uint8_t *digest, uint32_t low = 0)
+        {
+            if (_count == 0)
+                _offset = pos;
+            else if (_pos.empty() && (pos != _offset + _count * window || _last != window))
+                materialize();
+
+            if (!_pos.empty()) {
+                _pos.push_back(pos);
+                _len.push_back(size);
+            }
+
+            // Grows, or gets room for low halves if the hash was changed after the last reserve
+            reserve(_count == _cap ? std::max<size_t>(16, _cap * 2) : _cap);
+            auto h = reinterpret_cast<uint32_t *>(_buf.data());
+            h[_count] = adler32;
+            if (_wide)
+                h[_cap + _count] = low;
+            memcpy(_buf.data() + digests() + _count * DIGEST, digest, DIGEST);
+            _last = size;
+            ++_count;
+        }
+
+        // Adds blocks and holes of the next part of the same file
+        void append(const CompactSignature &other)
+        {
+            if (window == 0) {
+                window = other.window;
+                hash = other.hash;
+            }
+            // Parts of a session arrive one by one, growing to the exact size would copy all blocks every time
+            if (_count + other._count > _cap)
+                reserve(std::max(_count + other._count, _cap * 2));
+            for (size_t i = 0; i < other._count; ++i)
+                push(other.pos(i), other.length(i), other.adler32(i), other.digest(i), uint32_t(other.key(i)));
+            holes.insert(holes.end(), other.holes.begin(), other.holes.end());
+        }
+
+        void reserve(size_t n)
+        {
+            bool wide = hash == Hash::Rolling64;
+            if (n <= _cap && wide == _wide)
+                return;
+
+            // Adler32 hashes, low halves of Rolling64 and digests one after another in one buffer
+            n = std::max(n, _cap);
+            std::vector<uint8_t> buf(n * stride(wide));
+            memcpy(buf.data(), _buf.data(), _count * sizeof(uint32_t));
+            if (wide && _wide)
+                memcpy(buf.data() + n * sizeof(uint32_t), hashes() + _cap, _count * sizeof(uint32_t));
+            memcpy(buf.data() + n * (stride(wide) - DIGEST), _buf.data() + digests(), _count * DIGEST);
+            _buf.swap(buf);
+            _cap = n;
+            _wide = wide;
+        }
+
+        bool operator==(const CompactSignature &other) const
+        {
+            if (window != other.window || hash != other.hash || _count != other._count || !(holes == other.holes))
+                return false;
+
+            for (size_t i = 0; i < _count; ++i) {
+                if (pos(i) != other.pos(i) || length(i) != other.length(i) || key(i) != other.key(i)
+                    || memcmp(digest(i), other.digest(i), DIGEST) != 0)
+                    return false;
+            }
+
+            return true;
+        }
+
+        void serialize(std::ostream &os) const
+        {
+            os.write(COMPACT_SIGNATURE_HEADER.c_str(), COMPACT_SIGNATURE_HEADER.size());
+            write(os, window);
+            write(os, _count);
+            write(os, _offset);
+            write(os, _last);
+            // Explicit positions in the first bit, Rolling64 in the second one
+            uint8_t flag = (_pos.empty() ? 0 : 1) | (hash == Hash::Rolling64 ? 2 : 0);
+            write(os, flag);
+            if (flag & 1) {
+                os.write(reinterpret_cast<const char *>(_pos.data()), _count * sizeof(_pos[0]));
+                os.write(reinterpret_cast<const char *>(_len.data()), _count * sizeof(_len[0]));
+            }
+            os.write(reinterpret_cast<const char *>(hashes()), _count * sizeof(uint32_t));
+            if (flag & 2) {
+                // Only a hash changed after the last push has no low halves
+                if (_wide)
+                    os.write(reinterpret_cast<const char *>(hashes() + _cap), _count * sizeof(uint32_t));
+                else
+                    for (size_t i = 0; i < _count; ++i)
+                        write(os, uint32_t(0));
+            }
+            os.write(reinterpret_cast<const char *>(_buf.data() + digests()), _count * DIGEST);
+            write(os, holes.size());
+            for (auto &h : holes) {
+                write(os, h.pos);
+                write(os, h.size);
+            }
+        }
+
+        bool deserialize(std::istream &os)
+        {
+            std::string header(COMPACT_SIGNATURE_HEADER.size(), '\0');
+            os.read(header.data(), header.size());
+            if (header != COMPACT_SIGNATURE_HEADER)
+                return false;
+
+            size_t count = 0;
+            uint8_t flag = 0;
+            read(os, window);
+            read(os, count);
+            read(os, _offset);
+            read(os, _last);
+            read(os, flag);
+            if (!os)
+                return false;
+
+            // A corrupted count must not allocate more than the stream could have
+            size_t block = stride(flag & 2) + ((flag & 1) ? sizeof(size_t) + sizeof(uint32_t) : 0);
+            if (count > unread(os) / block)
+                return false;
+
+            _count = 0;
+            _cap = 0;
+            _wide = false;
+            _buf.clear();
+            _pos.clear();
+            _len.clear();
+            holes.clear();
+            hash = flag & 2 ? Hash::Rolling64 : Hash::Adler32;
+            reserve(count);
+            if (flag & 1) {
+                _pos.resize(count);
+                _len.resize(count);
+                os.read(reinterpret_cast<char *>(_pos.data()), count * sizeof(_pos[0]));
+                os.read(reinterpret_cast<char *>(_len.data()), count * sizeof(_len[0]));
+            }
+            os.read(reinterpret_cast<char *>(_buf.data()), count * sizeof(uint32_t) * (_wide ? 2 : 1));
+            os.read(reinterpret_cast<char *>(_buf.data() + digests()), count * DIGEST);
+            _count = count;
+
+            size_t n = 0;
+            read(os, n);
+            for (size_t i = 0; i < n && os; ++i) {
+                Signature::Hole h;
+                read(os, h.pos);
+                read(os, h.size);
+                holes.push_back(h);
+            }
+
+            return bool(os);
+        }
+
+        uint32_t window = 0;
+        Hash hash = Hash::Adler32;
+        std::vector<Signature::Hole> holes;
+
+    private:
+        template<class T>
+        static void write(std::ostream &os, const T &value)
+        {
+            os.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        template<class T>
+        static void read(std::istream &os, T &value)
+        {
+            os.read(reinterpret_cast<char *>(&value), sizeof(value));
+        }
+
+        // Bytes of a block in the buffer
+        static size_t stride(bool wide)
+        {
+            return sizeof(uint32_t) * (wide ? 2 : 1) + DIGEST;
+        }
+
+        const uint32_t *hashes() const { return reinterpret_cast<const uint32_t *>(_buf.data()); }
+        // Offset of digests in the buffer
+        size_t digests() const { return _cap * (stride(_wide) - DIGEST); }
+
+        // Blocks are not contiguous anymore, positions and sizes are kept explicitly
+        void materialize()
+        {
+            _pos.resize(_count);
+            _len.resize(_count);
+            for (size_t i = 0; i < _count; ++i) {
+                _pos[i] = _offset + i * window;
+                _len[i] = i + 1 == _count ? _last : window;
+            }
+        }
+
+        std::vector<uint8_t> _buf;
+        size_t _cap = 0;
+        // The buffer has low halves of Rolling64 after Adler32 hashes
+        bool _wide = false;
+        size_t _count = 0;
+        // Position of the first block and size of the last one for implicit blocks
+        size_t _offset = 0;
+        size_t _last = 0;
+        std::vector<size_t> _pos;
+        std::vector<uint32_t> _len;
+    };
+}
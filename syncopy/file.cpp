@@ -3,12 +3,24 @@
  *********************************************************/
 
 #include "file.h"
+#include "reader.h"
+#include "mapping.h"
+#include "metrics.h"
+#include "trace.h"
 #include <fstream>
 #include <cstdio>
 #include <time.h>
 #include <utime.h>
 #include <sys/stat.h>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <string.h>
 
 #if __has_include(<experimental/filesystem>)
 #include <experimental/filesystem>
@@ -35,19 +47,171 @@ static std::string md5(const unsigned char *data, size_t len)
     return toString(result);
 }
 
+static const uint8_t ZERO[1 << 16] = {};
+
+// Adds size zero bytes to md5 without reading them
+static void zeros(MD5_CTX &ctx, size_t size)
+{
+    for (size_t n = 0; n < size; n += sizeof(ZERO))
+        MD5_Update(&ctx, ZERO, std::min(size - n, sizeof(ZERO)));
+}
+
+// Reads size bytes at pos unless the file ends, returns bytes read or -1
+static ssize_t preadFull(int fd, uint8_t *data, size_t size, size_t pos)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, data + done, size - done, pos + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+static bool pwriteFull(int fd, const uint8_t *data, size_t size, size_t pos)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, data + done, size - done, pos + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+
+    return true;
+}
+
+// Calls fn for every index below count on threads, the calling one included
+static void parallel(size_t threads, size_t count, const std::function<void(size_t)> &fn)
+{
+    std::atomic<size_t> next = {0};
+    auto worker = [&] {
+        for (size_t i = next++; i < count; i = next++)
+            fn(i);
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min(threads, count); ++i)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+}
+
 static struct stat stat(const std::string &path)
 {
-    struct stat st;
+    struct stat st = {};
     stat(path.c_str(), &st);
     return st;
 }
 
 namespace syncopy
 {
+    // Bytes written by a patch between writebacks when pages are not kept in the page cache
+    static const size_t WRITEBACK = 8 << 20;
+    // Smallest window repeated from the output, smaller ones are not worth a chunk
+    static const uint32_t REPEAT = 64;
+    // Window rolled for a signature without one, it has nothing to match
+    static const uint32_t LITERAL = 1 << 16;
+
+    /**
+     * md5 of the whole data and of every Delta::SEGMENT bytes of it.
+     * Hashing segments costs another md5 of every byte, so it is enabled only for parallel patches.
+     */
+    class Segmented
+    {
+    public:
+        explicit Segmented(bool enabled) : _enabled(enabled)
+        {
+            MD5_Init(&_whole);
+            MD5_Init(&_part);
+        }
+
+        void update(const uint8_t *data, size_t size)
+        {
+            MD5_Update(&_whole, data, size);
+            while (_enabled && size > 0) {
+                size_t n = std::min(size, Delta::SEGMENT - _hashed % Delta::SEGMENT);
+                MD5_Update(&_part, data, n);
+                _hashed += n;
+                data += n;
+                size -= n;
+                if (_hashed % Delta::SEGMENT == 0) {
+                    _segments.emplace_back();
+                    MD5_Final(_segments.back().data(), &_part);
+                    MD5_Init(&_part);
+                }
+            }
+        }
+
+        void zeros(size_t size)
+        {
+            for (size_t n = 0; n < size; n += sizeof(ZERO))
+                update(ZERO, std::min(size - n, sizeof(ZERO)));
+        }
+
+        // Hex md5 of the whole data, digests of segments are moved to segments
+        std::string final(std::vector<Delta::Digest> &segments)
+        {
+            if (_enabled && _hashed % Delta::SEGMENT != 0) {
+                _segments.emplace_back();
+                MD5_Final(_segments.back().data(), &_part);
+            }
+
+            uint8_t md5[MD5_DIGEST_LENGTH];
+            MD5_Final(md5, &_whole);
+            segments = std::move(_segments);
+            return toString(md5);
+        }
+
+    private:
+        bool _enabled;
+        MD5_CTX _whole;
+        MD5_CTX _part;
+        size_t _hashed = 0;
+        std::vector<Delta::Digest> _segments;
+    };
+
+    // Work of signatures, deltas and patches of the process
+    struct FileMetrics
+    {
+        Metrics &m = Metrics::global();
+        Histogram &signature = m.histogram("syncopy_signature_seconds", "Time to create a signature");
+        Counter &signed_bytes = m.counter("syncopy_signature_bytes_total", "Bytes hashed by signatures");
+        Histogram &delta = m.histogram("syncopy_delta_seconds", "Time to create a delta, without flushes");
+        Counter &matched = m.counter("syncopy_delta_matched_bytes_total", "Bytes of deltas found in signatures");
+        Counter &literal = m.counter("syncopy_delta_literal_bytes_total", "Bytes of deltas sent as data");
+        Counter &zero = m.counter("syncopy_delta_zero_bytes_total", "Bytes of deltas sent as zero runs");
+        Counter &repeated = m.counter("syncopy_delta_repeated_bytes_total", "Bytes of deltas copied from the output written before");
+        // By CompactSignature::Hash
+        Counter *hits[2] = {
+            &m.counter("syncopy_delta_weak_hits_total", "Rolling hashes found in signatures", "hash=\"adler32\""),
+            &m.counter("syncopy_delta_weak_hits_total", "Rolling hashes found in signatures", "hash=\"rolling64\"")};
+        Counter *misses[2] = {
+            &m.counter("syncopy_delta_strong_misses_total", "Rolling hashes found in signatures with another md5", "hash=\"adler32\""),
+            &m.counter("syncopy_delta_strong_misses_total", "Rolling hashes found in signatures with another md5", "hash=\"rolling64\"")};
+        Histogram &patch = m.histogram("syncopy_patch_seconds", "Time to apply a delta, without waiting for it");
+        Counter &patched = m.counter("syncopy_patch_bytes_total", "Bytes written by patches");
+    };
+
+    static FileMetrics &metrics()
+    {
+        static FileMetrics result;
+        return result;
+    }
+
     size_t File::size() const
     {
-        std::ifstream in(_path, std::ifstream::ate | std::ifstream::binary);
-        return in.tellg();
+        struct stat st;
+        return ::stat(_path.c_str(), &st) == 0 ? st.st_size : size_t(-1);
     }
 
     time_t File::mtime() const
@@ -55,6 +219,11 @@ namespace syncopy
         return stat(_path).st_mtime;
     }
 
+    mode_t File::mode() const
+    {
+        return stat(_path).st_mode;
+    }
+
     std::string File::parent_path() const
     {
         fs::path p = _path;
@@ -118,175 +287,1090 @@ namespace syncopy
 
     std::vector<uint8_t> File::readAll() const
     {
-        std::ifstream input(_path, std::ios::binary);
-        std::vector<uint8_t> buffer(std::istreambuf_iterator<char>(input), {});
+        std::vector<uint8_t> buffer;
+        auto reader = Reader::open(_path);
+        if (!reader)
+            return buffer;
+
+        buffer.reserve(size());
+        const uint8_t *data = nullptr;
+        size_t n = 0;
+        while (reader->next(data, n))
+            buffer.insert(buffer.end(), data, data + n);
+
+        if (reader->truncated())
+            buffer.clear();
         return buffer;
     }
 
-    Signature File::signature(uint32_t window) const
+    std::vector<uint8_t> File::read(size_t offset, size_t size) const
+    {
+        std::unique_ptr<FILE, int(*)(FILE*)> f(fopen(_path.c_str(), "r"), &fclose);
+        if (!f || fseek(f.get(), offset, SEEK_SET) != 0)
+            return {};
+
+        std::vector<uint8_t> result(size);
+        result.resize(fread(result.data(), 1, size, f.get()));
+        return result;
+    }
+
+    std::string File::md5(size_t size) const
     {
-        Signature result;
-        result.window = window;
         std::unique_ptr<FILE, int(*)(FILE*)> f(fopen(_path.c_str(), "r"), &fclose);
         if (!f)
-            return result;
+            return {};
 
-        uint8_t buf[window];
+        uint8_t md5[MD5_DIGEST_LENGTH];
+        MD5_CTX mdContext;
+        MD5_Init(&mdContext);
+        std::vector<uint8_t> buf(1 << 16);
         size_t bytesRead = 0;
-        size_t pos = 0;
-        checksum::Adler32 a(window);
-        while ((bytesRead = fread(buf, 1, sizeof(buf), f.get())) > 0) {
+        size_t total = 0;
+        while (total < size && (bytesRead = fread(buf.data(), 1, std::min(buf.size(), size - total), f.get())) > 0) {
+            MD5_Update(&mdContext, buf.data(), bytesRead);
+            total += bytesRead;
+        }
+        MD5_Final(md5, &mdContext);
+        if (size != size_t(-1) && total != size)
+            return {};
+
+        return toString(md5);
+    }
+
+    static size_t distance(const std::string &a, const std::string &b)
+    {
+        std::vector<size_t> prev(b.size() + 1), cur(b.size() + 1);
+        for (size_t j = 0; j <= b.size(); ++j)
+            prev[j] = j;
+        for (size_t i = 1; i <= a.size(); ++i) {
+            cur[0] = i;
+            for (size_t j = 1; j <= b.size(); ++j)
+                cur[j] = std::min({prev[j] + 1, cur[j - 1] + 1, prev[j - 1] + (a[i - 1] != b[j - 1])});
+            std::swap(prev, cur);
+        }
+
+        return prev[b.size()];
+    }
+
+    /**
+     * Finds an existing file in the same dir which is likely similar to this one,
+     * like rsync --fuzzy does: by the name distance, the extension and the size.
+     * Used as a basis for new files, so rotated logs or versioned files are sent as a delta.
+     */
+    std::string File::fuzzy(size_t size) const
+    {
+        auto dir = parent_path();
+        auto name = filename();
+        std::string result;
+        size_t best = 60;
+        std::error_code ec;
+        for (auto &entry : fs::directory_iterator(dir.empty() ? "." : dir, ec)) {
+            if (!fs::is_regular_file(entry.status()))
+                continue;
+
+            File f(entry.path());
+            auto n = f.filename();
+            if (n == name || f.ext() == ".syncopy")
+                continue;
+
+            size_t score = distance(name, n) * 100 / std::max(name.size(), n.size());
+            if (f.ext() != ext())
+                score += 30;
+            if (size > 0) {
+                auto fsize = f.size();
+                score += 50 * (std::max(size, fsize) - std::min(size, fsize)) / std::max(size, fsize);
+            }
+
+            if (score < best) {
+                best = score;
+                result = f.path();
+            }
+        }
+
+        return result;
+    }
+
+    Signature File::signature(uint32_t window) const
+    {
+        return signature(window, 0, size_t(-1));
+    }
+
+    Signature File::signature(uint32_t window, size_t offset, size_t count) const
+    {
+        // Chunks of signatures keep Adler32 only
+        return compactSignature(window, offset, count, CompactSignature::Hash::Adler32).expand();
+    }
+
+    // Calls fn with the rolling hash specialized for common windows, or with the generic one
+    template<template<uint32_t> class Rolling, class F>
+    static auto rolling(uint32_t window, F &&fn)
+    {
+        switch (window) {
+        case 512: { Rolling<512> a; return fn(a); }
+        case 1000: { Rolling<1000> a; return fn(a); }
+        case 1024: { Rolling<1024> a; return fn(a); }
+        case 2048: { Rolling<2048> a; return fn(a); }
+        case 4096: { Rolling<4096> a; return fn(a); }
+        case 8192: { Rolling<8192> a; return fn(a); }
+        default: { Rolling<0> a(window); return fn(a); }
+        }
+    }
+
+    template<class F>
+    static auto rolling(uint32_t window, CompactSignature::Hash hash, F &&fn)
+    {
+        if (hash == CompactSignature::Hash::Rolling64)
+            return rolling<checksum::BasicRolling64>(window, fn);
+        return rolling<checksum::BasicAdler32>(window, fn);
+    }
+
+    // Keys of blocks in signatures, Adler32 leaves the low half empty
+    template<uint32_t W>
+    static uint64_t key(const checksum::BasicAdler32<W> &a)
+    {
+        return uint64_t(a.hash()) << 32;
+    }
+
+    template<uint32_t W>
+    static uint64_t key(const checksum::BasicRolling64<W> &a)
+    {
+        return a.hash();
+    }
+
+    CompactSignature File::compactSignature(uint32_t window, size_t offset, size_t count, CompactSignature::Hash hash) const
+    {
+        return rolling(window, hash, [&](auto &a) { return sign(a, hash, offset, count); });
+    }
+
+    template<class Rolling>
+    CompactSignature File::sign(Rolling &a, CompactSignature::Hash hash, size_t offset, size_t count) const
+    {
+        Timer timer(metrics().signature);
+        Span span("signature", _path, "file");
+        const uint32_t window = a.window();
+        CompactSignature result;
+        result.window = window;
+        result.hash = hash;
+        size_t size = stat(_path).st_size;
+        size_t end = count < (size_t(-1) - offset) / window ? std::min(offset + count * window, size) : size;
+        if (offset >= end)
+            return result;
+
+        // Windows with data, windows inside of holes are not read but recorded as holes
+        std::vector<std::pair<size_t, size_t>> ranges;
+        for (auto &extent : extents()) {
+            size_t from = std::max(extent.first, offset);
+            size_t to = std::min(extent.first + extent.second, end);
+            if (from >= to)
+                continue;
+
+            from = offset + (from - offset) / window * window;
+            to = std::min(end, offset + (to - offset + window - 1) / window * window);
+            if (!ranges.empty() && ranges.back().second >= from)
+                ranges.back().second = std::max(ranges.back().second, to);
+            else
+                ranges.push_back({from, to});
+        }
+
+        // Blocks of the reader do not have to be aligned to the window
+        std::vector<uint8_t> buf(window);
+        size_t filled = 0;
+        size_t pos = offset;
+        uint8_t digest[MD5_DIGEST_LENGTH];
+        auto push = [&](const uint8_t *d, size_t size) {
             a.reset();
-            for (int i = 0; i < bytesRead; ++i)
-                a.eat(buf[i]);
-            result.chunks.push_back({pos, bytesRead, a.hash(), md5(buf, bytesRead)});
-            pos += bytesRead;
+            a.eat(d, size);
+            MD5(d, size, digest);
+            uint64_t k = key(a);
+            result.push(pos, size, k >> 32, digest, uint32_t(k));
+            pos += size;
+            filled = 0;
+        };
+
+        for (auto &range : ranges) {
+            if (range.first > pos)
+                result.holes.push_back({pos, range.first - pos});
+
+            pos = range.first;
+            auto reader = Reader::open(_path, range.first, range.second - range.first);
+            if (!reader)
+                return result;
+
+            const uint8_t *data = nullptr;
+            size_t n = 0;
+            while (reader->next(data, n)) {
+                metrics().signed_bytes.add(n);
+                while (n > 0) {
+                    // Whole windows are hashed in place
+                    if (filled == 0 && n >= window) {
+                        push(data, window);
+                        data += window;
+                        n -= window;
+                        continue;
+                    }
+
+                    size_t k = std::min<size_t>(n, window - filled);
+                    memcpy(buf.data() + filled, data, k);
+                    filled += k;
+                    data += k;
+                    n -= k;
+                    if (filled == window)
+                        push(buf.data(), filled);
+                }
+            }
+
+            if (filled > 0)
+                push(buf.data(), filled);
+
+            // Blocks of zeros instead of the data would be matched
+            if (reader->truncated()) {
+                std::cerr << "File truncated while signing: " << _path << std::endl;
+                CompactSignature empty;
+                empty.window = window;
+                empty.hash = hash;
+                return empty;
+            }
         }
 
+        if (end > pos)
+            result.holes.push_back({pos, end - pos});
+
         return result;
     }
 
-    static Signature::Chunk query(uint32_t hash, const std::map<uint32_t, std::vector<Signature::Chunk>> &m,
-        uint8_t *data, size_t size)
+    std::vector<std::pair<size_t, size_t>> File::extents() const
     {
-        auto it = m.find(hash);
-        if (it != m.end()) {
-            auto md5sum = md5(data, size);
-            for (auto &a : it->second) {
-                if (a.md5 == md5sum)
-                    return a;
+        std::vector<std::pair<size_t, size_t>> result;
+        int fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return result;
+
+        struct stat st;
+        size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+        for (size_t pos = 0; pos < size;) {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            if (data < 0) {
+                // The rest is a hole, otherwise holes are not supported
+                if (errno != ENXIO)
+                    result.push_back({pos, size - pos});
+                break;
             }
+
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+            size_t to = hole < 0 ? size : std::min<size_t>(hole, size);
+            if (size_t(data) >= to)
+                break;
+            result.push_back({data, to - data});
+            pos = to;
         }
 
-        return {};
+        close(fd);
+        return result;
     }
 
+    /**
+     * Blocks of a signature sorted by their 64 bit keys.
+     * A bitmap of hashes rejects most misses before searching.
+     * Windows of the source already rolled over are remembered by their positions in the output,
+     * so repeated content can be copied from the output of the patch.
+     */
+    class Matcher
+    {
+    public:
+        // Windows is how many windows may be remembered, the filter grows with them and the signature
+        Matcher(const CompactSignature &sig, size_t windows) : _sig(sig), _bits(bits(sig.size() + std::min(windows, OUTPUT))), _filter(_bits / 64)
+        {
+            _blocks.reserve(sig.size());
+            for (size_t i = 0; i < sig.size(); ++i) {
+                _blocks.push_back({sig.key(i), i});
+                size_t bit = mix(sig.key(i));
+                _filter[bit / 64] |= uint64_t(1) << (bit % 64);
+            }
+            // Blocks with the same hash are checked in the order of the file
+            std::sort(_blocks.begin(), _blocks.end());
+        }
+
+        bool empty() const { return _blocks.empty(); }
+
+        // False if no block has the hash
+        bool candidate(uint64_t hash) const
+        {
+            size_t bit = mix(hash);
+            return _filter[bit / 64] >> (bit % 64) & 1;
+        }
+
+        // Index of the block with the same hash and md5, -1 if not found
+        size_t find(uint64_t hash, const uint8_t *data, size_t size)
+        {
+            if (!candidate(hash))
+                return -1;
+
+            auto it = std::lower_bound(_blocks.begin(), _blocks.end(), std::make_pair(hash, size_t(0)));
+            if (it == _blocks.end() || it->first != hash)
+                return -1;
+
+            ++hits;
+            uint8_t digest[MD5_DIGEST_LENGTH];
+            MD5(data, size, digest);
+            for (; it != _blocks.end() && it->first == hash; ++it) {
+                if (memcmp(_sig.digest(it->second), digest, sizeof(digest)) == 0)
+                    return it->second;
+            }
+
+            ++misses;
+            return -1;
+        }
+
+        // Remembers a window of the source at pos, the first one of the same key is kept
+        void remember(uint64_t hash, size_t pos)
+        {
+            if (_remembered >= OUTPUT || hash == 0)
+                return;
+
+            if (2 * (_remembered + 1) > _output.size()) {
+                std::vector<std::pair<uint64_t, size_t>> old(std::max<size_t>(1024, _output.size() * 2));
+                old.swap(_output);
+                for (auto &e : old) {
+                    if (e.first != 0)
+                        *slot(e.first) = e;
+                }
+            }
+
+            auto it = slot(hash);
+            if (it->first == hash)
+                return;
+            *it = {hash, pos};
+            ++_remembered;
+            size_t bit = mix(hash);
+            _filter[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+
+        // Position of a remembered window with the hash, -1 if there is none
+        size_t remembered(uint64_t hash)
+        {
+            if (_output.empty())
+                return -1;
+            auto it = slot(hash);
+            return it->first == hash ? it->second : -1;
+        }
+
+        // Found rolling hashes and those of them with another md5, counted locally to keep find() cheap
+        size_t hits = 0;
+        size_t misses = 0;
+
+    private:
+        // Bits of the filter, about 32 per block keep false candidates near 3%
+        static const size_t FILTER = 1 << 20;
+        static const size_t MAX_FILTER = 1 << 25;
+        // Remembered windows, 16 bytes each at half load
+        static const size_t OUTPUT = 1 << 16;
+
+        static size_t bits(size_t blocks)
+        {
+            size_t result = FILTER;
+            while (result < blocks * 32 && result < MAX_FILTER)
+                result <<= 1;
+            return result;
+        }
+
+        // Folds both halves of the key, Adler32 keys have only the high one
+        size_t mix(uint64_t hash) const
+        {
+            hash ^= hash >> 32;
+            return (hash ^ hash >> 16) & (_bits - 1);
+        }
+
+        // Slot of the key or the empty one where it goes, probed linearly
+        std::pair<uint64_t, size_t> *slot(uint64_t hash)
+        {
+            size_t mask = _output.size() - 1;
+            size_t i = size_t((hash ^ hash >> 32) * 0x9e3779b97f4a7c15ull >> 32) & mask;
+            while (_output[i].first != 0 && _output[i].first != hash)
+                i = (i + 1) & mask;
+            return &_output[i];
+        }
+
+        const CompactSignature &_sig;
+        std::vector<std::pair<uint64_t, size_t>> _blocks;
+        size_t _bits;
+        std::vector<uint64_t> _filter;
+        // Remembered windows by key, 0 is an empty slot
+        std::vector<std::pair<uint64_t, size_t>> _output;
+        size_t _remembered = 0;
+    };
+
     Delta File::delta(const Signature &sig) const
+    {
+        return delta(CompactSignature(sig), size_t(-1), {});
+    }
+
+    Delta File::delta(const Signature &sig, size_t flush_size, const std::function<bool(Delta &)> &flush) const
+    {
+        return delta(CompactSignature(sig), flush_size, flush);
+    }
+
+    Delta File::delta(const CompactSignature &sig, size_t flush_size, const std::function<bool(Delta &)> &flush,
+                      bool segments) const
+    {
+        // Rolling by a window of 0 would never advance, the whole file is literal data then
+        if (sig.window == 0) {
+            CompactSignature none;
+            none.window = LITERAL;
+            return rolling(none.window, none.hash, [&](auto &a) { return roll(a, none, flush_size, flush, segments); });
+        }
+
+        return rolling(sig.window, sig.hash, [&](auto &a) { return roll(a, sig, flush_size, flush, segments); });
+    }
+
+    template<class Rolling>
+    Delta File::roll(Rolling a, const CompactSignature &sig, size_t flush_size, const std::function<bool(Delta &)> &flush,
+                     bool segments) const
     {
         Delta result;
-        std::unique_ptr<FILE, int(*)(FILE*)> f(fopen(_path.c_str(), "r"), &fclose);
-        if (!f)
+        const uint32_t window = a.window();
+        auto st = stat(_path);
+        if (access(_path.c_str(), R_OK) != 0)
             return result;
 
-        std::map<uint32_t, std::vector<Signature::Chunk>> m;
-        for (auto a : sig.chunks)
-            m[a.adler32].push_back(a);
+        Span span("delta", _path, "file");
+        auto started = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::duration flushing = {};
+        Matcher m(sig, window >= REPEAT ? st.st_size / window : 0);
+        // Chunks are counted before they are flushed
+        auto account = [&]() {
+            auto &metric = metrics();
+            for (auto &chunk : result.chunks)
+                (chunk.zero() ? metric.zero : chunk.output ? metric.repeated : chunk.data.empty() ? metric.matched : metric.literal).add(chunk.size);
+            metric.hits[int(sig.hash)]->add(m.hits);
+            metric.misses[int(sig.hash)]->add(m.misses);
+            m.hits = 0;
+            m.misses = 0;
+        };
 
-        uint8_t buf[sig.window];
-        size_t bytesRead = 0;
-        checksum::Adler32 a(sig.window);
         std::vector<uint8_t> data;
+        // Mapped files are rolled over in place, otherwise blocks are copied to data
+        const uint8_t *mapped = nullptr;
+        size_t fed = 0;
+        auto base = [&]() { return mapped ? mapped : data.data(); };
+        auto available = [&]() { return mapped ? fed : data.size(); };
+        // Bytes before base()[begin] are already emitted
+        size_t begin = 0;
         size_t i = 0;
-        size_t bytes_count = 0;
-        int start = 0;
+        // Position of base()[begin] in the source file
+        size_t offset = 0;
+        // Approximate size of chunks not flushed yet
+        size_t pending = 0;
+        // Bytes until the next window is remembered
+        size_t next = 1;
 
-        uint8_t md5[MD5_DIGEST_LENGTH];
-        MD5_CTX mdContext;
-        MD5_Init(&mdContext);
+        // True if the output at pos, which is the source at pos, has the bytes of the window
+        auto repeats = [&](size_t pos, const uint8_t *d) {
+            size_t first = offset - begin;
+            if (pos >= first)
+                return memcmp(base() + (pos - first), d, window) == 0;
+            auto bytes = read(pos, window);
+            return bytes.size() == window && memcmp(bytes.data(), d, window) == 0;
+        };
 
-        while ((bytesRead = fread(buf, 1, sizeof(buf), f.get())) > 0) {
-            MD5_Update(&mdContext, buf, bytesRead);
-            data.insert(data.end(), buf, buf + bytesRead);
-            while (!m.empty() && i < data.size()) {
-                start = i - sig.window;
+        // One segment is verified by md5 of the whole result anyway
+        Segmented hashed(segments && size_t(st.st_size) > Delta::SEGMENT);
 
-                if (start >= 0)
-                    a.update(data[i], data[start]);
+        // Emits the rest of the data of an extent
+        auto finish = [&]() {
+            if (begin < available()) {
+                auto d = base() + begin;
+                size_t rest = available() - begin;
+                size_t k = m.find(key(a), d, rest);
+                if (k != size_t(-1))
+                    result.chunks.push_back({sig.pos(k), offset, {}, sig.length(k)});
                 else
-                    a.eat(data[i]);
+                    result.literal(offset, d, rest);
+                pending += rest + sizeof(Delta::Chunk);
+                offset += rest;
+            }
+
+            a.reset();
+            data.clear();
+            mapped = nullptr;
+            fed = 0;
+            begin = 0;
+            i = 0;
+            next = 1;
+        };
+
+        // Holes of sparse files are sent as zero runs, without reading and rolling through them
+        auto hole = [&](size_t size) {
+            if (size == 0)
+                return;
+            hashed.zeros(size);
+            result.chunks.push_back({size_t(-1), offset, {}, size});
+            pending += sizeof(Delta::Chunk);
+            offset += size;
+        };
+
+        for (auto &extent : extents()) {
+            hole(extent.first - offset);
+            auto reader = Reader::open(_path, extent.first, extent.second);
+            if (!reader)
+                return {};
+
+            const uint8_t *block = nullptr;
+            size_t blockSize = 0;
+            while (reader->next(block, blockSize)) {
+                hashed.update(block, blockSize);
+                if (reader->mapped() && !mapped)
+                    mapped = block;
+                // The block is rolled by windows so flushes happen as often as before
+                for (size_t step = 0; step < blockSize; step += window) {
+                    size_t bytesRead = std::min<size_t>(window, blockSize - step);
+                    if (mapped) {
+                        fed += bytesRead;
+                    } else {
+                        // Drop emitted bytes once they outweigh the rest instead of erasing on every match
+                        if (begin > 0 && begin >= data.size() - begin) {
+                            data.erase(data.begin(), data.begin() + begin);
+                            begin = 0;
+                        }
+                        data.insert(data.end(), block + step, block + step + bytesRead);
+                    }
+
+                    auto d = base() + begin;
+                    size_t n = m.empty() ? 0 : available() - begin;
+                    while (i < n) {
+                        if (i >= window)
+                            a.update(d[i], d[i - window]);
+                        else
+                            a.eat(d[i]);
+                        ++i;
+
+                        // The window is d[i - window, i), most hashes are rejected without a call
+                        if (i < window)
+                            continue;
+
+                        size_t missed = i - window;
+                        if (window >= REPEAT && --next == 0) {
+                            m.remember(key(a), offset + missed);
+                            next = window;
+                        }
+
+                        if (!m.candidate(key(a)))
+                            continue;
+
+                        size_t k = m.find(key(a), &d[missed], window);
+                        // Windows emitted before this one
+                        size_t pos = k == size_t(-1) ? m.remembered(key(a)) : size_t(-1);
+                        if (k == size_t(-1) && (pos == size_t(-1) || pos + window > offset + missed || !repeats(pos, &d[missed])))
+                            continue;
 
-                if (start + 1 >= 0) {
-                    auto matched = query(a.hash(), m, &data.data()[start + 1], sig.window);
-                    if (matched.size > 0) {
                         a.reset();
-                        auto missed_pos = bytes_count - i;
-                        std::vector<uint8_t> missed_data(data.begin(), data.begin() + start + 1);
-                        if (!missed_data.empty())
-                            result.chunks.push_back({size_t(-1), missed_pos, missed_data, missed_data.size()});
-
-                        data.erase(data.begin(), data.begin() + i + 1);
-                        result.chunks.push_back({matched.pos, missed_pos + missed_data.size(), {}, matched.size});
-                        i = -1;
+                        if (missed > 0)
+                            result.literal(offset, d, missed);
+
+                        if (k != size_t(-1))
+                            result.chunks.push_back({sig.pos(k), offset + missed, {}, sig.length(k)});
+                        else
+                            result.repeat(pos, offset + missed, window);
+                        pending += missed + sizeof(Delta::Chunk);
+                        begin += i;
+                        offset += i;
+                        d += i;
+                        n -= i;
+                        i = 0;
+                        next = 1;
+                    }
+
+                    if (!flush)
+                        continue;
+
+                    // Bytes behind the rolling window cannot start a match anymore
+                    size_t missed = m.empty() ? available() - begin : (i > window ? i - window : 0);
+                    if (pending + missed < flush_size)
+                        continue;
+
+                    if (missed > 0) {
+                        auto d = base() + begin;
+                        result.literal(offset, d, missed);
+                        begin += missed;
+                        offset += missed;
+                        i -= std::min(i, missed);
                     }
+
+                    account();
+                    auto flushed = std::chrono::steady_clock::now();
+                    if (!flush(result))
+                        return {};
+                    flushing += std::chrono::steady_clock::now() - flushed;
+                    result.clear();
+                    pending = 0;
                 }
+            }
 
-                ++i;
-                ++bytes_count;
+            finish();
+            if (reader->truncated()) {
+                std::cerr << "File truncated while creating delta: " << _path << std::endl;
+                return {};
             }
         }
 
-        if (!data.empty()) {
-            auto matched = query(a.hash(), m, data.data(), data.size());
-            result.chunks.push_back(
-                matched.size > 0 ? Delta::Chunk{matched.pos, bytes_count - i, {}, matched.size}
-                                 : Delta::Chunk{size_t(-1), bytes_count - i, data, data.size()}
-            );
-        }
+        hole(std::max<size_t>(st.st_size, offset) - offset);
 
-        MD5_Final(md5, &mdContext);
-        result.md5 = toString(md5);
-        result.st = stat(_path);
+        result.md5 = hashed.final(result.segments);
+        result.st = st;
 
+        account();
+        metrics().delta.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - started - flushing).count());
         return result;
     }
 
     bool File::patch(const Delta &delta)
     {
-        std::unique_ptr<FILE, int(*)(FILE*)> f(fopen(_path.c_str(), "r"), &fclose);
-        if (!f)
+        Span span("patch", _path, "file");
+        Patcher patcher(_path);
+        if (!patcher.ok())
             return false;
 
-        uint8_t md5[MD5_DIGEST_LENGTH];
-        MD5_CTX mdContext;
-        MD5_Init(&mdContext);
+        for (auto &chunk : delta.chunks) {
+            if (!patcher.apply(chunk))
+                return false;
+        }
+
+        return patcher.commit(delta.md5, delta.st);
+    }
+
+    // Writes chunks to fd of size bytes on threads, copies from src and other files, false if any fails
+    static bool apply(const Delta &delta, size_t threads, int src, int fd, size_t size)
+    {
+        // Chunks are split into ranges of about the same size, a few per thread
+        std::vector<std::pair<size_t, size_t>> ranges;
+        size_t part = std::max<size_t>(1 << 20, size / (threads * 4));
+        for (size_t i = 0, bytes = 0; i < delta.chunks.size(); ++i) {
+            if (ranges.empty() || bytes >= part) {
+                ranges.push_back({i, i});
+                bytes = 0;
+            }
+            ranges.back().second = i + 1;
+            bytes += delta.chunks[i].zero() ? 0 : delta.chunks[i].size;
+        }
+
+        auto copy = [fd](int from, const Delta::Chunk &chunk, std::vector<uint8_t> &buf) {
+            for (size_t done = 0; done < chunk.size;) {
+                size_t k = std::min(chunk.size - done, buf.size());
+                if (preadFull(from, buf.data(), k, chunk.src_pos + done) != ssize_t(k)
+                    || !pwriteFull(fd, buf.data(), k, chunk.dst_pos + done))
+                    return false;
+                done += k;
+            }
+            return true;
+        };
+
+        std::atomic<bool> failed = {false};
+        parallel(threads, ranges.size(), [&](size_t r) {
+            std::vector<uint8_t> buf(1 << 20);
+            std::string other_path;
+            std::unique_ptr<FILE, int(*)(FILE*)> other(nullptr, &fclose);
+            for (size_t i = ranges[r].first; i < ranges[r].second && !failed; ++i) {
+                auto &chunk = delta.chunks[i];
+                bool ok = true;
+                if (!chunk.data.empty()) {
+                    ok = pwriteFull(fd, chunk.data.data(), chunk.data.size(), chunk.dst_pos);
+                } else if (chunk.zero() || chunk.output) {
+                    continue;
+                } else if (!chunk.path.empty()) {
+                    if (chunk.path != other_path) {
+                        other.reset(fopen(chunk.path.c_str(), "r"));
+                        other_path = chunk.path;
+                    }
+                    ok = other && copy(fileno(other.get()), chunk, buf);
+                } else {
+                    ok = copy(src, chunk, buf);
+                }
+
+                if (!ok) {
+                    std::cerr << "Could not apply chunk, pos: " << chunk.dst_pos << " size: " << chunk.size << std::endl;
+                    failed = true;
+                }
+            }
+        });
+        if (failed)
+            return false;
+
+        // Copies of the output may read what other copies write, they are applied in order
+        std::vector<uint8_t> buf(1 << 20);
+        for (auto &chunk : delta.chunks) {
+            if (chunk.output && (chunk.src_pos + chunk.size > chunk.dst_pos || !copy(fd, chunk, buf))) {
+                std::cerr << "Could not repeat output, pos: " << chunk.src_pos << " size: " << chunk.size << std::endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // md5 of size bytes of fd at pos
+    static bool hash(int fd, size_t pos, size_t size, uint8_t *md5)
+    {
+        std::vector<uint8_t> buf(std::min<size_t>(size, 1 << 20));
+        MD5_CTX ctx;
+        MD5_Init(&ctx);
+        for (size_t done = 0; done < size; done += buf.size()) {
+            size_t k = std::min(size - done, buf.size());
+            if (preadFull(fd, buf.data(), k, pos + done) != ssize_t(k))
+                return false;
+            MD5_Update(&ctx, buf.data(), k);
+        }
+
+        MD5_Final(md5, &ctx);
+        return true;
+    }
+
+    bool File::patch(const Delta &delta, size_t threads)
+    {
+        if (threads <= 1)
+            return patch(delta);
+
+        Span span("patch", _path, "file");
+        auto started = std::chrono::steady_clock::now();
+        std::unique_ptr<FILE, int(*)(FILE*)> src(fopen(_path.c_str(), "r"), &fclose);
+        if (!src) {
+            std::cerr << "Could not open file: " << _path << std::endl;
+            return false;
+        }
 
         // @TODO: Avoid tmp dir
-        std::string fn = "/tmp/" + filename() + ".syncopy";
-        std::unique_ptr<FILE, int(*)(FILE*)> syncopy(fopen(fn.c_str(), "w"), &fclose);
-        if (!syncopy) {
+        std::string fn = "/tmp/" + filename() + ".XXXXXX.syncopy";
+        int fd = mkstemps(fn.data(), 8);
+        if (fd < 0) {
             std::cerr << "Could not open file: " << fn << std::endl;
             return false;
         }
 
-        for (auto &chunk : delta.chunks) {
-            if (!chunk.data.empty()) {
-                MD5_Update(&mdContext, chunk.data.data(), chunk.data.size());
-                fwrite(chunk.data.data(), sizeof(char), chunk.data.size(), syncopy.get());
-                continue;
+        File tmp(fn);
+        size_t size = 0;
+        for (auto &chunk : delta.chunks)
+            size = std::max(size, chunk.dst_pos + chunk.size);
+
+        // Zero runs stay holes, data is allocated at once so concurrent writes do not fragment the file
+        bool ok = ftruncate(fd, size) == 0;
+        for (size_t i = 0, j = 0; ok && i < delta.chunks.size(); i = std::max(j, i + 1)) {
+            size_t end = delta.chunks[i].dst_pos;
+            for (j = i; j < delta.chunks.size() && !delta.chunks[j].zero() && delta.chunks[j].dst_pos == end; ++j)
+                end += delta.chunks[j].size;
+            // Filesystems without fallocate allocate on write, but no space fails before any thread writes
+            if (end > delta.chunks[i].dst_pos &&
+                fallocate(fd, FALLOC_FL_KEEP_SIZE, delta.chunks[i].dst_pos, end - delta.chunks[i].dst_pos) != 0 &&
+                errno != EOPNOTSUPP && errno != ENOSYS) {
+                std::cerr << "Could not allocate: " << fn << " error: " << strerror(errno) << std::endl;
+                ok = false;
             }
+        }
 
-            fseek(f.get(), chunk.src_pos, SEEK_SET);
-            uint8_t buf[chunk.size];
-            int bytesRead = 0;
-            while ((bytesRead = fread(buf, 1, sizeof(buf), f.get())) > 0) {
-                if (bytesRead == chunk.size) {
-                    MD5_Update(&mdContext, buf, bytesRead);
-                    fwrite(buf, sizeof(char), bytesRead, syncopy.get());
-                } else {
-                    std::cerr << "Size mismatch, size: " << chunk.size << " bytesRead:" << bytesRead << std::endl;
-                    File(fn).remove();
-                    return false;
-                }
-                break;
+        ok = ok && apply(delta, threads, fileno(src.get()), fd, size);
+
+        // Segments are read back and hashed on threads, otherwise the whole result is
+        size_t count = (size + Delta::SEGMENT - 1) / Delta::SEGMENT;
+        if (ok && count > 0 && delta.segments.size() == count) {
+            std::atomic<bool> verified = {true};
+            parallel(threads, count, [&](size_t i) {
+                Delta::Digest digest;
+                size_t pos = i * Delta::SEGMENT;
+                if (!hash(fd, pos, std::min(size - pos, Delta::SEGMENT), digest.data()) || digest != delta.segments[i])
+                    verified = false;
+            });
+            ok = verified;
+        } else if (ok) {
+            uint8_t md5[MD5_DIGEST_LENGTH];
+            ok = hash(fd, 0, size, md5) && toString(md5) == delta.md5;
+        }
+
+        if (!ok) {
+            std::cerr << "Could not patch: " << _path << std::endl;
+            close(fd);
+            tmp.remove();
+            return false;
+        }
+
+        if (Reader::options.cache != Reader::Cache::Keep) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            posix_fadvise(fileno(src.get()), 0, 0, POSIX_FADV_DONTNEED);
+        }
+
+        close(fd);
+        tmp.touch(delta.st.st_mtime);
+        tmp.chmod(delta.st.st_mode);
+        tmp.rename(_path);
+        metrics().patch.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+        metrics().patched.add(size);
+        return true;
+    }
+
+    Patcher::Patcher(const std::string &path, const std::string &basis)
+        : _path(path)
+        , _src(fopen((basis.empty() ? path : basis).c_str(), "r"), &fclose)
+        , _dst(nullptr, &fclose)
+        , _other(nullptr, &fclose)
+    {
+        if (!_src)
+            return;
+
+        if (Reader::options.backend == Reader::Backend::Mmap) {
+            _src_map.reset(new Mapping(fileno(_src.get())));
+            _src_map->advise(MADV_WILLNEED);
+        }
+
+        // @TODO: Avoid tmp dir
+        std::string fn = "/tmp/" + File(path).filename() + ".XXXXXX.syncopy";
+        int fd = mkstemps(fn.data(), 8);
+        // Read back by copies of the output
+        if (fd >= 0)
+            _dst.reset(fdopen(fd, "w+"));
+        if (!_dst) {
+            std::cerr << "Could not open file: " << fn << std::endl;
+            return;
+        }
+
+        _tmp = fn;
+        MD5_Init(&_md5);
+    }
+
+    Patcher::~Patcher()
+    {
+        _dst.reset();
+        if (!_committed && !_tmp.empty())
+            File(_tmp).remove();
+    }
+
+    bool Patcher::apply(const Delta::Chunk &chunk)
+    {
+        auto started = std::chrono::steady_clock::now();
+        bool result = copy(chunk);
+        _busy += std::chrono::steady_clock::now() - started;
+        return result;
+    }
+
+    bool Patcher::copy(const Delta::Chunk &chunk)
+    {
+        if (!chunk.data.empty()) {
+            write(chunk.data.data(), chunk.data.size());
+            return true;
+        }
+
+        if (chunk.zero()) {
+            zero(chunk.size);
+            return true;
+        }
+
+        if (chunk.output)
+            return repeat(chunk);
+
+        auto src = _src.get();
+        auto map = _src_map.get();
+        if (!chunk.path.empty()) {
+            if (chunk.path != _other_path) {
+                _other.reset(fopen(chunk.path.c_str(), "r"));
+                _other_path = chunk.path;
+                _other_map.reset(_other && _src_map ? new Mapping(fileno(_other.get())) : nullptr);
+            }
+            src = _other.get();
+            map = _other_map.get();
+            if (!src) {
+                std::cerr << "Could not open file: " << chunk.path << std::endl;
+                return false;
             }
         }
 
-        MD5_Final(md5, &mdContext);
-        auto md5sum = toString(md5);
-        if (delta.md5 != md5sum) {
-            std::cerr << "Cound not patch, md5 mismatch: '" << delta.md5 <<"' != '" << md5sum << "'" << std::endl;
-            File(fn).remove();
+        if (map && map->ok()) {
+            if (chunk.src_pos > map->size() || chunk.size > map->size() - chunk.src_pos) {
+                std::cerr << "Size mismatch, size: " << chunk.size << " mapped:" << map->size() << std::endl;
+                return false;
+            }
+
+            write(map->data() + chunk.src_pos, chunk.size);
+            if (map->truncated()) {
+                std::cerr << "Mapped file truncated while patching: " << _path << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        fseek(src, chunk.src_pos, SEEK_SET);
+        std::vector<uint8_t> buf(chunk.size);
+        size_t bytesRead = fread(buf.data(), 1, buf.size(), src);
+        if (bytesRead != chunk.size) {
+            std::cerr << "Size mismatch, size: " << chunk.size << " bytesRead:" << bytesRead << std::endl;
+            return false;
+        }
+
+        write(buf.data(), bytesRead);
+        return true;
+    }
+
+    /**
+     * Copies bytes written before, they are read back from the temporary file.
+     * Zeros at the end are not written yet, reading them returns less.
+     */
+    bool Patcher::repeat(const Delta::Chunk &chunk)
+    {
+        if (chunk.src_pos > _written || chunk.size > _written - chunk.src_pos) {
+            std::cerr << "Could not repeat output, pos: " << chunk.src_pos << " size: " << chunk.size
+                      << " written: " << _written << std::endl;
             return false;
         }
 
-        syncopy.reset();
-        File result(fn);
-        result.touch(delta.st.st_mtime);
-        result.chmod(delta.st.st_mode);
-        result.rename(_path);
+        fflush(_dst.get());
+        std::vector<uint8_t> buf(std::min<size_t>(chunk.size, WRITEBACK));
+        for (size_t done = 0; done < chunk.size;) {
+            size_t n = std::min(buf.size(), chunk.size - done);
+            ssize_t bytesRead = pread(fileno(_dst.get()), buf.data(), n, chunk.src_pos + done);
+            if (bytesRead < 0) {
+                std::cerr << "Could not read file: " << _tmp << std::endl;
+                return false;
+            }
+
+            memset(buf.data() + bytesRead, 0, n - bytesRead);
+            write(buf.data(), n);
+            done += n;
+        }
+
         return true;
     }
 
+    bool Patcher::commit(const std::string &md5, const struct stat &st)
+    {
+        Span span("commit", _path, "file");
+        auto started = std::chrono::steady_clock::now();
+        uint8_t result[MD5_DIGEST_LENGTH];
+        MD5_Final(result, &_md5);
+        auto md5sum = toString(result);
+        if (md5 != md5sum) {
+            std::cerr << "Cound not patch, md5 mismatch: '" << md5 <<"' != '" << md5sum << "'" << std::endl;
+            return false;
+        }
+
+        if (!_block.empty())
+            signBlock();
+
+        // Zeros at the end are skipped too
+        fflush(_dst.get());
+        if (ftruncate(fileno(_dst.get()), _written) != 0) {
+            std::cerr << "Could not resize file: " << _tmp << std::endl;
+            return false;
+        }
+
+        if (Reader::options.cache != Reader::Cache::Keep) {
+            writeback(true);
+            posix_fadvise(fileno(_src.get()), 0, 0, POSIX_FADV_DONTNEED);
+            if (_other)
+                posix_fadvise(fileno(_other.get()), 0, 0, POSIX_FADV_DONTNEED);
+        }
+
+        _dst.reset();
+        File tmp(_tmp);
+        tmp.touch(st.st_mtime);
+        tmp.chmod(st.st_mode);
+        tmp.rename(_path);
+        _committed = true;
+        _busy += std::chrono::steady_clock::now() - started;
+        metrics().patch.observe(std::chrono::duration<double>(_busy).count());
+        metrics().patched.add(_written);
+        return true;
+    }
+
+    void Patcher::sign(uint32_t window)
+    {
+        _sig.window = window;
+        _block.reserve(window);
+    }
+
+    void Patcher::write(const uint8_t *data, size_t size)
+    {
+        MD5_Update(&_md5, data, size);
+        fwrite(data, sizeof(char), size, _dst.get());
+        _written += size;
+        if (Reader::options.cache != Reader::Cache::Keep && _written - _synced >= WRITEBACK)
+            writeback(false);
+        if (_sig.window > 0)
+            sign(data, size);
+    }
+
+    /**
+     * Starts writeback of new pages and drops the previous ones, which are written by now,
+     * so a patch never keeps more than two ranges of dirty pages in the page cache.
+     */
+    void Patcher::writeback(bool all)
+    {
+        fflush(_dst.get());
+        int fd = fileno(_dst.get());
+#ifdef SYNC_FILE_RANGE_WRITE
+        if (all) {
+            sync_file_range(fd, _dropped, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        } else {
+            sync_file_range(fd, _synced, _written - _synced, SYNC_FILE_RANGE_WRITE);
+            sync_file_range(fd, _dropped, _synced - _dropped, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+#else
+        if (all)
+            fdatasync(fd);
+#endif
+        posix_fadvise(fd, _dropped, all ? 0 : _synced - _dropped, POSIX_FADV_DONTNEED);
+        _dropped = all ? _written : _synced;
+        _synced = _written;
+    }
+
+    /**
+     * Zeros are not written: the output gets a hole by seeking over them.
+     * Whole blocks of zeros are recorded as holes of the signature.
+     */
+    void Patcher::zero(size_t size)
+    {
+        zeros(_md5, size);
+        fflush(_dst.get());
+        _written += size;
+        fseeko(_dst.get(), _written, SEEK_SET);
+        if (_sig.window == 0)
+            return;
+
+        auto signZeros = [this](size_t n) {
+            for (size_t k = 0; k < n; k += sizeof(ZERO))
+                sign(ZERO, std::min(n - k, sizeof(ZERO)));
+        };
+
+        size_t head = std::min(size, (_sig.window - _block.size()) % _sig.window);
+        signZeros(head);
+        size_t whole = (size - head) / _sig.window * _sig.window;
+        if (whole > 0) {
+            auto &holes = _sig.holes;
+            if (!holes.empty() && holes.back().pos + holes.back().size == _signed)
+                holes.back().size += whole;
+            else
+                holes.push_back({_signed, whole});
+            _signed += whole;
+        }
+        signZeros(size - head - whole);
+    }
+
+    void Patcher::sign(const uint8_t *data, size_t size)
+    {
+        while (size > 0) {
+            size_t n = std::min<size_t>(size, _sig.window - _block.size());
+            _block.insert(_block.end(), data, data + n);
+            data += n;
+            size -= n;
+            if (_block.size() == _sig.window)
+                signBlock();
+        }
+    }
+
+    void Patcher::signBlock()
+    {
+        checksum::Adler32 a(_sig.window);
+        for (auto c : _block)
+            a.eat(c);
+        _sig.chunks.push_back({_signed, _block.size(), a.hash(), ::md5(_block.data(), _block.size())});
+        _signed += _block.size();
+        _block.clear();
+    }
+
     std::vector<File> File::files(const std::string &dir)
     {
         std::vector<File> result;
@@ -6,7 +6,11 @@
 
 #include "checksum.h"
 #include "signature.h"
+#include "compact.h"
 #include <string>
+#include <memory>
+#include <functional>
+#include <chrono>
 
 namespace syncopy
 {
@@ -37,6 +41,7 @@ namespace syncopy
         std::string ext() const;
         size_t size() const;
         time_t mtime() const;
+        mode_t mode() const;
 
         void write(const std::vector<uint8_t> &data);
         void append(const std::vector<uint8_t> &data);
@@ -46,10 +51,29 @@ namespace syncopy
         void touch(time_t ts);
         void chmod(mode_t mode);
         std::vector<uint8_t> readAll() const;
+        std::vector<uint8_t> read(size_t offset, size_t size) const;
+        // md5 of the first size bytes, empty if the file is shorter
+        std::string md5(size_t size = size_t(-1)) const;
+        std::string fuzzy(size_t size) const;
 
         Signature signature(uint32_t window = 1000) const;
+        Signature signature(uint32_t window, size_t offset, size_t count) const;
+        CompactSignature compactSignature(uint32_t window, size_t offset = 0, size_t count = size_t(-1),
+                                          CompactSignature::Hash hash = CompactSignature::Hash::Rolling64) const;
+        // Ranges of data as (pos, size), holes of sparse files are skipped
+        std::vector<std::pair<size_t, size_t>> extents() const;
         Delta delta(const Signature &sig) const;
+        Delta delta(const Signature &sig, size_t flush_size, const std::function<bool(Delta &)> &flush) const;
+        // Segments adds md5 of every Delta::SEGMENT bytes for patch(delta, threads), it costs another md5 of the file
+        Delta delta(const CompactSignature &sig, size_t flush_size, const std::function<bool(Delta &)> &flush,
+                    bool segments = false) const;
         bool patch(const Delta &delta);
+        /**
+         * Applies ranges of the delta on threads by pread/pwrite into a preallocated file.
+         * The result is verified by md5 of segments in any order, by md5 of the whole result
+         * if the delta has no segments. Copies of the output are applied after other chunks.
+         */
+        bool patch(const Delta &delta, size_t threads);
 
         static std::vector<File> files(const std::string &dir);
         static std::vector<std::string> dirs(const std::string &dir);
@@ -57,6 +81,75 @@ namespace syncopy
         static void rmdir(const std::string &dir);
         static void chdir(const std::string &dir);
     private:
+        // Kernels for a rolling hash of the window, the delta one keeps the hash by value in registers
+        template<class Rolling>
+        CompactSignature sign(Rolling &a, CompactSignature::Hash hash, size_t offset, size_t count) const;
+        template<class Rolling>
+        Delta roll(Rolling a, const CompactSignature &sig, size_t flush_size, const std::function<bool(Delta &)> &flush,
+                   bool segments) const;
+
         std::string _path;
     };
+
+    class Mapping;
+
+    /**
+     * Applies a delta to the destination file chunk by chunk.
+     * Allows to patch a file by a delta that arrives in parts
+     * without keeping the whole delta in memory.
+     * Matched chunks are copied from the basis file, which is the file itself by default.
+     *
+     * @example:
+     *  Patcher p(dst.path());
+     *  for (auto &chunk : delta.chunks)
+     *      p.apply(chunk);
+     *  p.commit(delta.md5, delta.st);
+     */
+    class Patcher
+    {
+    public:
+        explicit Patcher(const std::string &path, const std::string &basis = {});
+        ~Patcher();
+
+        bool ok() const { return _src && _dst; }
+        bool apply(const Delta::Chunk &chunk);
+        bool commit(const std::string &md5, const struct stat &st);
+
+        // Creates the signature of the result while writing it
+        void sign(uint32_t window);
+        const Signature &signature() const { return _sig; }
+
+    private:
+        bool copy(const Delta::Chunk &chunk);
+        bool repeat(const Delta::Chunk &chunk);
+        void write(const uint8_t *data, size_t size);
+        void zero(size_t size);
+        void writeback(bool all);
+        void sign(const uint8_t *data, size_t size);
+        void signBlock();
+
+        std::string _path;
+        std::string _tmp;
+        std::unique_ptr<FILE, int(*)(FILE*)> _src;
+        std::unique_ptr<FILE, int(*)(FILE*)> _dst;
+        // Another file chunks are copied from
+        std::string _other_path;
+        std::unique_ptr<FILE, int(*)(FILE*)> _other;
+        // Used instead of reading by the mmap backend
+        std::unique_ptr<Mapping> _src_map;
+        std::unique_ptr<Mapping> _other_map;
+        MD5_CTX _md5;
+        bool _committed = false;
+        // Written bytes, started and finished writeback
+        size_t _written = 0;
+        size_t _synced = 0;
+        size_t _dropped = 0;
+        // Time spent in apply and commit, without waiting for chunks
+        std::chrono::steady_clock::duration _busy = {};
+
+        Signature _sig;
+        std::vector<uint8_t> _block;
+        // Position of the block being signed
+        size_t _signed = 0;
+    };
 }
\ No newline at end of file
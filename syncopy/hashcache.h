@@ -0,0 +1,85 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include "file.h"
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace syncopy
+{
+    /**
+     * Cache of whole file md5 sums.
+     * An entry is valid while size and mtime of the file are not changed.
+     */
+    class HashCache
+    {
+    public:
+        struct Entry
+        {
+            size_t size = 0;
+            time_t mtime = 0;
+            std::string md5;
+        };
+
+        /**
+         * Returns md5 of the file, hashes the file only if it has been changed.
+         */
+        std::string md5(const File &f)
+        {
+            auto size = f.size();
+            auto mtime = f.mtime();
+            std::string result;
+            if (find(f.path(), size, mtime, result))
+                return result;
+
+            result = f.md5();
+            if (!result.empty() && f.size() == size && f.mtime() == mtime)
+                set(f.path(), size, mtime, result);
+
+            return result;
+        }
+
+        bool find(const std::string &path, size_t size, time_t mtime, std::string &md5) const
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            auto it = _entries.find(path);
+            if (it == _entries.end() || it->second.size != size || it->second.mtime != mtime)
+                return false;
+
+            md5 = it->second.md5;
+            return true;
+        }
+
+        void set(const std::string &path, size_t size, time_t mtime, const std::string &md5)
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            _entries[path] = {size, mtime, md5};
+        }
+
+        void rename(const std::string &from, const std::string &to)
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            auto it = _entries.find(from);
+            if (it == _entries.end())
+                return;
+
+            auto entry = it->second;
+            _entries.erase(it);
+            _entries[to] = entry;
+        }
+
+        void erase(const std::string &path)
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            _entries.erase(path);
+        }
+
+    private:
+        mutable std::mutex _mutex;
+        std::map<std::string, Entry> _entries;
+    };
+}
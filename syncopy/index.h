@@ -0,0 +1,218 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include "compact.h"
+#include <map>
+#include <array>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+namespace syncopy
+{
+    /**
+     * Content addressed index of blocks of all files in a tree.
+     * Maps md5 of a block to the file and position the block can be copied from.
+     * Every file containing the block owns it, the block is found while any of them is indexed.
+     * Only full blocks of the window size are indexed.
+     *
+     * @example:
+     *  index.add(path, file.signature(index.window));
+     *  Index::Location loc;
+     *  if (index.find(md5, loc))
+     *      ... copy loc.size bytes from loc.pos of loc.path
+     */
+    class Index
+    {
+    public:
+        struct Location
+        {
+            std::string path;
+            size_t pos = 0;
+            size_t size = 0;
+        };
+
+        explicit Index(uint32_t window) : window(window)
+        {
+        }
+
+        void add(const std::string &path, const Signature &sig)
+        {
+            if (sig.window != window)
+                return;
+
+            std::lock_guard<std::mutex> locker(_mutex);
+            erase(path);
+            auto file = _files.emplace(path, std::vector<Digest>{}).first;
+            for (auto &chunk : sig.chunks) {
+                Digest d;
+                if (chunk.size == window && digest(chunk.md5, d))
+                    own(*file, d, chunk.pos);
+            }
+        }
+
+        void add(const std::string &path, const CompactSignature &sig)
+        {
+            if (sig.window != window)
+                return;
+
+            std::lock_guard<std::mutex> locker(_mutex);
+            erase(path);
+            auto file = _files.emplace(path, std::vector<Digest>{}).first;
+            for (size_t i = 0; i < sig.size(); ++i) {
+                if (sig.length(i) != window)
+                    continue;
+
+                Digest d;
+                memcpy(d.data(), sig.digest(i), d.size());
+                own(*file, d, sig.pos(i));
+            }
+        }
+
+        /**
+         * Removes the file or all files of the dir.
+         */
+        void remove(const std::string &path)
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            erase(path);
+            auto prefix = path + "/";
+            for (auto it = _files.lower_bound(prefix); it != _files.end() && it->first.compare(0, prefix.size(), prefix) == 0;)
+                erase((it++)->first);
+        }
+
+        void rename(const std::string &from, const std::string &to)
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            auto it = _files.find(from);
+            if (it == _files.end())
+                return;
+
+            erase(to);
+            auto file = _files.emplace(to, std::move(it->second)).first;
+            for (auto &d : file->second) {
+                auto &block = _blocks[d];
+                for (auto *owner = &block.owner; owner; owner = block.next(owner)) {
+                    if (owner->path == &it->first)
+                        owner->path = &file->first;
+                }
+            }
+            _files.erase(it);
+        }
+
+        bool find(const std::string &md5, Location &loc) const
+        {
+            Digest d;
+            if (!digest(md5, d))
+                return false;
+
+            std::lock_guard<std::mutex> locker(_mutex);
+            auto it = _blocks.find(d);
+            if (it == _blocks.end())
+                return false;
+
+            loc = {*it->second.owner.path, it->second.owner.pos, window};
+            return true;
+        }
+
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> locker(_mutex);
+            return _blocks.size();
+        }
+
+        const uint32_t window;
+
+    private:
+        using Digest = std::array<uint8_t, 16>;
+
+        struct Hash
+        {
+            size_t operator()(const Digest &d) const
+            {
+                size_t h = 0;
+                memcpy(&h, d.data(), sizeof(h));
+                return h;
+            }
+        };
+
+        struct Owner
+        {
+            // Key of _files
+            const std::string *path = nullptr;
+            size_t pos = 0;
+        };
+
+        // The block is copied from its first owner, most blocks have no others
+        struct Block
+        {
+            Owner owner;
+            std::vector<Owner> others;
+
+            // Owner after the given one or nullptr
+            Owner *next(Owner *o)
+            {
+                size_t i = o == &owner ? 0 : o - others.data() + 1;
+                return i < others.size() ? &others[i] : nullptr;
+            }
+        };
+
+        static bool digest(const std::string &md5, Digest &d)
+        {
+            return checksum::unhex(md5, d.data(), d.size());
+        }
+
+        // Adds the file as an owner of the block, must be called under _mutex
+        void own(std::pair<const std::string, std::vector<Digest>> &file, const Digest &d, size_t pos)
+        {
+            auto result = _blocks.emplace(d, Block{Owner{&file.first, pos}, {}});
+            if (!result.second) {
+                // Blocks of a file are added at once, so a block repeated in it was owned last
+                auto &block = result.first->second;
+                auto &last = block.others.empty() ? block.owner : block.others.back();
+                if (last.path == &file.first)
+                    return;
+                block.others.push_back({&file.first, pos});
+            }
+            file.second.push_back(d);
+        }
+
+        // Blocks owned by other files are copied from them after, must be called under _mutex
+        void erase(const std::string &path)
+        {
+            auto it = _files.find(path);
+            if (it == _files.end())
+                return;
+
+            for (auto &d : it->second) {
+                auto b = _blocks.find(d);
+                if (b == _blocks.end())
+                    continue;
+
+                auto &block = b->second;
+                if (block.owner.path == &it->first) {
+                    if (block.others.empty()) {
+                        _blocks.erase(b);
+                        continue;
+                    }
+                    block.owner = block.others.back();
+                    block.others.pop_back();
+                } else {
+                    block.others.erase(std::remove_if(block.others.begin(), block.others.end(),
+                        [&](const Owner &o) { return o.path == &it->first; }), block.others.end());
+                }
+            }
+            _files.erase(it);
+        }
+
+        mutable std::mutex _mutex;
+        std::unordered_map<Digest, Block, Hash> _blocks;
+        std::map<std::string, std::vector<Digest>> _files;
+    };
+}
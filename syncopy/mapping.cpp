@@ -0,0 +1,105 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "mapping.h"
+#include <mutex>
+#include <thread>
+
+namespace syncopy
+{
+    // Mapping the SIGBUS handler looks up without locks, users count handlers which may still touch it
+    struct MappingSlot
+    {
+        std::atomic<Mapping *> mapping = {nullptr};
+        std::atomic<int> users = {0};
+    };
+
+    static const size_t SLOTS = 256;
+    static MappingSlot mappings[SLOTS];
+    static struct sigaction previous;
+
+    Mapping::~Mapping()
+    {
+        for (auto &slot : mappings) {
+            Mapping *self = this;
+            if (!slot.mapping.compare_exchange_strong(self, nullptr))
+                continue;
+
+            // A handler which loaded this mapping before it was unregistered is waited for
+            while (slot.users.load() > 0)
+                std::this_thread::yield();
+            break;
+        }
+
+        if (_data)
+            munmap(const_cast<uint8_t *>(_data), _size);
+    }
+
+    void Mapping::map(int fd)
+    {
+        static std::once_flag installed;
+        std::call_once(installed, [] {
+            struct sigaction action = {};
+            action.sa_sigaction = &Mapping::fault;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGBUS, &action, &previous);
+        });
+
+        struct stat st = {};
+        if (fstat(fd, &st) != 0)
+            return;
+
+        if (st.st_size > 0) {
+            void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED)
+                return;
+            _data = static_cast<const uint8_t *>(ptr);
+            _size = st.st_size;
+
+            // Unguarded mappings would crash the process if the file is truncated
+            bool registered = false;
+            for (auto &slot : mappings) {
+                Mapping *empty = nullptr;
+                if (slot.mapping.compare_exchange_strong(empty, this)) {
+                    registered = true;
+                    break;
+                }
+            }
+            if (!registered)
+                return;
+        }
+
+        // Empty files are valid but have nothing to map
+        _ok = true;
+    }
+
+    void Mapping::fault(int sig, siginfo_t *info, void *context)
+    {
+        auto addr = static_cast<const uint8_t *>(info->si_addr);
+        for (auto &slot : mappings) {
+            slot.users.fetch_add(1);
+            Mapping *m = slot.mapping.load();
+            if (!m || addr < m->_data || addr >= m->_data + m->_size) {
+                slot.users.fetch_sub(1);
+                continue;
+            }
+
+            // Pages from the faulting one to the end are zeros, the access is retried on return
+            size_t page = sysconf(_SC_PAGESIZE);
+            auto from = reinterpret_cast<uint8_t *>(reinterpret_cast<uintptr_t>(addr) / page * page);
+            size_t size = m->_data + m->_size - from;
+            bool zeroed = mmap(from, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED;
+            if (zeroed)
+                m->_truncated = true;
+            slot.users.fetch_sub(1);
+            if (!zeroed)
+                break;
+            return;
+        }
+
+        // Not a mapped file, the access is retried with the handler there was before
+        sigaction(SIGBUS, &previous, nullptr);
+    }
+}
@@ -0,0 +1,78 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <atomic>
+
+namespace syncopy
+{
+    /**
+     * Read only mapping of a whole file.
+     * A file truncated while it is mapped raises SIGBUS on access to the pages past its end.
+     * Mappings are registered for a SIGBUS handler which replaces those pages by zeros and
+     * marks the mapping truncated, so the data read from it must be dropped if truncated() is set.
+     * If there are too many mappings to register, the mapping is not ok and the file is read instead.
+     *
+     * @example:
+     *  Mapping m(path);
+     *  if (m.ok())
+     *      m.advise(MADV_SEQUENTIAL);
+     *  std::vector<uint8_t> bytes(m.data(), m.data() + m.size());
+     *  if (m.truncated())
+     *      bytes.clear();
+     */
+    class Mapping
+    {
+    public:
+        explicit Mapping(const std::string &path)
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return;
+
+            map(fd);
+            close(fd);
+        }
+
+        // The descriptor is not owned and may be closed after
+        explicit Mapping(int fd)
+        {
+            map(fd);
+        }
+
+        ~Mapping();
+
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+
+        bool ok() const { return _ok; }
+        const uint8_t *data() const { return _data; }
+        size_t size() const { return _size; }
+        // True if pages were accessed past the end of the file, they read as zeros
+        bool truncated() const { return _truncated; }
+
+        void advise(int advice) const
+        {
+            if (_data)
+                madvise(const_cast<uint8_t *>(_data), _size, advice);
+        }
+
+    private:
+        void map(int fd);
+        static void fault(int sig, siginfo_t *info, void *context);
+
+        const uint8_t *_data = nullptr;
+        size_t _size = 0;
+        bool _ok = false;
+        std::atomic<bool> _truncated = {false};
+    };
+}
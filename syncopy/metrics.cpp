@@ -0,0 +1,146 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "metrics.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+namespace syncopy
+{
+    // Integers are printed as they are, others with enough digits for seconds
+    static std::string format(double value)
+    {
+        if (std::isinf(value))
+            return value > 0 ? "+Inf" : "-Inf";
+        std::ostringstream st;
+        if (value == std::floor(value) && std::fabs(value) < 1e15)
+            st << int64_t(value);
+        else
+            st << std::setprecision(9) << value;
+        return st.str();
+    }
+
+    // name{labels} or name{labels,extra}
+    static std::string sample(const std::string &name, const std::string &labels, const std::string &extra = {})
+    {
+        if (labels.empty() && extra.empty())
+            return name;
+        if (labels.empty() || extra.empty())
+            return name + "{" + labels + extra + "}";
+        return name + "{" + labels + "," + extra + "}";
+    }
+
+    Metrics &Metrics::global()
+    {
+        // Never destroyed, metrics may be updated by threads still running at exit
+        static Metrics *metrics = new Metrics;
+        return *metrics;
+    }
+
+    Metrics::Family &Metrics::family(const std::string &name, const std::string &help, Type type)
+    {
+        auto it = _families.find(name);
+        if (it == _families.end()) {
+            it = _families.emplace(name, Family{}).first;
+            it->second.type = type;
+            it->second.help = help;
+        } else if (it->second.type != type) {
+            std::cerr << "Metric registered with another type: " << name << std::endl;
+        }
+
+        return it->second;
+    }
+
+    Counter &Metrics::counter(const std::string &name, const std::string &help, const std::string &labels)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        auto &m = family(name, help, Type::Counter).counters[labels];
+        if (!m)
+            m.reset(new Counter);
+        return *m;
+    }
+
+    Gauge &Metrics::gauge(const std::string &name, const std::string &help, const std::string &labels)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        auto &m = family(name, help, Type::Gauge).gauges[labels];
+        if (!m)
+            m.reset(new Gauge);
+        return *m;
+    }
+
+    Histogram &Metrics::histogram(const std::string &name, const std::string &help, const std::string &labels)
+    {
+        std::lock_guard<std::mutex> locker(_mutex);
+        auto &m = family(name, help, Type::Histogram).histograms[labels];
+        if (!m)
+            m.reset(new Histogram);
+        return *m;
+    }
+
+    void Metrics::samples(const std::string &name, const Family &f,
+                          const std::function<void(const std::string &, double)> &out) const
+    {
+        for (auto &c : f.counters)
+            out(sample(name, c.first), c.second->value());
+        for (auto &g : f.gauges)
+            out(sample(name, g.first), g.second->value());
+        for (auto &h : f.histograms) {
+            for (size_t i = 0; i <= Histogram::BUCKETS; ++i) {
+                auto le = i < Histogram::BUCKETS ? format(Histogram::BOUNDS[i]) : "+Inf";
+                out(sample(name + "_bucket", h.first, "le=\"" + le + "\""), h.second->count(i));
+            }
+            out(sample(name + "_sum", h.first), h.second->sum());
+            out(sample(name + "_count", h.first), h.second->count());
+        }
+    }
+
+    std::map<std::string, double> Metrics::snapshot() const
+    {
+        std::map<std::string, double> result;
+        std::lock_guard<std::mutex> locker(_mutex);
+        for (auto &f : _families)
+            samples(f.first, f.second, [&](const std::string &s, double v) { result[s] = v; });
+
+        return result;
+    }
+
+    std::string Metrics::prometheus() const
+    {
+        static const char *types[] = {"counter", "gauge", "histogram"};
+        std::ostringstream st;
+        std::lock_guard<std::mutex> locker(_mutex);
+        for (auto &f : _families) {
+            st << "# HELP " << f.first << " " << f.second.help << "\n";
+            st << "# TYPE " << f.first << " " << types[int(f.second.type)] << "\n";
+            samples(f.first, f.second, [&](const std::string &s, double v) { st << s << " " << format(v) << "\n"; });
+        }
+
+        return st.str();
+    }
+
+    bool Metrics::dump(const std::string &path) const
+    {
+        auto tmp = path + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::out | std::ios::trunc);
+            f << prometheus();
+            if (!f.good()) {
+                std::cerr << "Could not write metrics: " << tmp << std::endl;
+                return false;
+            }
+        }
+
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::cerr << "Could not write metrics: " << path << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,156 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace syncopy
+{
+    // Monotonic count of events or bytes
+    class Counter
+    {
+    public:
+        void add(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+        uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> _value = {0};
+    };
+
+    // Current value like a queue depth
+    class Gauge
+    {
+    public:
+        void set(int64_t v) { _value.store(v, std::memory_order_relaxed); }
+        void add(int64_t n) { _value.fetch_add(n, std::memory_order_relaxed); }
+        int64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<int64_t> _value = {0};
+    };
+
+    /**
+     * Distribution of durations in seconds by fixed buckets from 100us to 100s.
+     * Observing is one relaxed increment of a bucket, the sum is kept in nanoseconds.
+     */
+    class Histogram
+    {
+    public:
+        static constexpr double BOUNDS[] = {0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 50, 100};
+        static constexpr size_t BUCKETS = sizeof(BOUNDS) / sizeof(BOUNDS[0]);
+
+        void observe(double seconds)
+        {
+            size_t i = 0;
+            while (i < BUCKETS && seconds > BOUNDS[i])
+                ++i;
+            _buckets[i].fetch_add(1, std::memory_order_relaxed);
+            _sum.fetch_add(uint64_t(seconds * 1e9), std::memory_order_relaxed);
+        }
+
+        // Observations not greater than BOUNDS[i], i == BUCKETS is all of them
+        uint64_t count(size_t i = BUCKETS) const
+        {
+            uint64_t result = 0;
+            for (size_t k = 0; k <= i && k <= BUCKETS; ++k)
+                result += _buckets[k].load(std::memory_order_relaxed);
+            return result;
+        }
+
+        double sum() const { return _sum.load(std::memory_order_relaxed) / 1e9; }
+
+    private:
+        // The last one is +Inf
+        std::atomic<uint64_t> _buckets[BUCKETS + 1] = {};
+        std::atomic<uint64_t> _sum = {0};
+    };
+
+    /**
+     * Named metrics of the process.
+     * Metrics are registered once and never removed, so callers keep references
+     * and update them without locks. Names and labels follow Prometheus.
+     *
+     * @example:
+     *  static auto &bytes = Metrics::global().counter("syncopy_bytes_total", "Bytes sent");
+     *  bytes.add(n);
+     *  {
+     *      Timer t(Metrics::global().histogram("syncopy_rpc_seconds", "Time of rpc calls", "method=\"md5\""));
+     *      ...
+     *  }
+     *  Metrics::global().dump("/var/lib/node_exporter/syncopy.prom");
+     */
+    class Metrics
+    {
+    public:
+        static Metrics &global();
+
+        Counter &counter(const std::string &name, const std::string &help, const std::string &labels = {});
+        Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels = {});
+        Histogram &histogram(const std::string &name, const std::string &help, const std::string &labels = {});
+
+        // Samples by their Prometheus names with labels, like `syncopy_rpc_seconds_count{method="md5"}`
+        std::map<std::string, double> snapshot() const;
+        // Text exposition format
+        std::string prometheus() const;
+        // Writes prometheus() to a temporary file renamed to path, so readers never see a partial file
+        bool dump(const std::string &path) const;
+
+    private:
+        enum class Type
+        {
+            Counter,
+            Gauge,
+            Histogram
+        };
+
+        struct Family
+        {
+            Type type;
+            std::string help;
+            std::map<std::string, std::unique_ptr<Counter>> counters;
+            std::map<std::string, std::unique_ptr<Gauge>> gauges;
+            std::map<std::string, std::unique_ptr<Histogram>> histograms;
+        };
+
+        Family &family(const std::string &name, const std::string &help, Type type);
+        void samples(const std::string &name, const Family &f, const std::function<void(const std::string &, double)> &out) const;
+
+        mutable std::mutex _mutex;
+        std::map<std::string, Family> _families;
+    };
+
+    /**
+     * Observes the time of its scope.
+     */
+    class Timer
+    {
+    public:
+        explicit Timer(Histogram &h) : _h(h), _start(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~Timer()
+        {
+            _h.observe(elapsed());
+        }
+
+        double elapsed() const
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+        }
+
+    private:
+        Histogram &_h;
+        std::chrono::steady_clock::time_point _start;
+    };
+}
@@ -0,0 +1,452 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "reader.h"
+#include "mapping.h"
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define SYNCOPY_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace syncopy
+{
+    Reader::Options Reader::options;
+
+    // Alignment of buffers, offsets and sizes for O_DIRECT
+    static const size_t ALIGN = 4096;
+    // Blocks a range must have for Auto to set up a ring, smaller ones are read faster by pread
+    static const size_t URING_BLOCKS = 4;
+
+    struct Free
+    {
+        void operator()(uint8_t *ptr) const { free(ptr); }
+    };
+
+    using Buffer = std::unique_ptr<uint8_t[], Free>;
+
+    static Buffer allocate(size_t size)
+    {
+        void *ptr = nullptr;
+        if (posix_memalign(&ptr, ALIGN, size) != 0)
+            throw std::bad_alloc();
+        return Buffer(static_cast<uint8_t *>(ptr));
+    }
+
+    /**
+     * Part of a file to read by blocks.
+     * With O_DIRECT reads start and end on aligned offsets, trim() cuts the requested bytes out of them.
+     */
+    struct Range
+    {
+        Range(int fd, size_t start, size_t end, bool direct, bool drop)
+            : fd(fd)
+            , start(start)
+            , end(end)
+            , pos(direct ? start / ALIGN * ALIGN : start)
+            , limit(direct ? (end + ALIGN - 1) / ALIGN * ALIGN : end)
+            , drop(drop)
+        {
+        }
+
+        bool trim(const uint8_t *buf, size_t offset, size_t done, const uint8_t *&data, size_t &size) const
+        {
+            size_t from = std::max(offset, start);
+            size_t to = std::min(offset + done, end);
+            if (to <= from)
+                return false;
+
+            data = buf + (from - offset);
+            size = to - from;
+            return true;
+        }
+
+        // Pages which are read already are dropped from the page cache
+        void consumed(size_t offset, size_t size) const
+        {
+            if (drop && size > 0)
+                posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+        }
+
+        int fd;
+        size_t start;
+        size_t end;
+        size_t pos;
+        size_t limit;
+        bool drop;
+    };
+
+    class PreadReader : public Reader
+    {
+    public:
+        PreadReader(const Range &range, size_t block)
+            : _range(range), _block(block), _buf(allocate(block))
+        {
+        }
+
+        ~PreadReader() override
+        {
+            _range.consumed(_last, _range.pos - _last);
+            close(_range.fd);
+        }
+
+        bool next(const uint8_t *&data, size_t &size) override
+        {
+            _range.consumed(_last, _range.pos - _last);
+            _last = _range.pos;
+            if (_range.pos >= _range.end)
+                return false;
+
+            size_t offset = _range.pos;
+            ssize_t n = pread(_range.fd, _buf.get(), std::min(_block, _range.limit - offset), offset);
+            if (n <= 0)
+                return false;
+
+            _range.pos += n;
+            return _range.trim(_buf.get(), offset, n, data, size);
+        }
+
+    private:
+        Range _range;
+        size_t _block;
+        Buffer _buf;
+        // Start of the block returned last
+        size_t _last = 0;
+    };
+
+    class MmapReader : public Reader
+    {
+    public:
+        MmapReader(int fd, size_t offset, size_t end, bool drop)
+            : _fd(fd), _map(new Mapping(fd)), _offset(offset), _end(std::min(end, _map->size())), _drop(drop)
+        {
+            if (_offset < _end) {
+                // Only the requested range is paged in ahead
+                size_t page = sysconf(_SC_PAGESIZE);
+                size_t from = _offset / page * page;
+                auto ptr = const_cast<uint8_t *>(_map->data()) + from;
+                madvise(ptr, _end - from, MADV_SEQUENTIAL);
+                madvise(ptr, _end - from, MADV_WILLNEED);
+            }
+        }
+
+        ~MmapReader() override
+        {
+            // Pages still mapped cannot be dropped
+            _map.reset();
+            if (_drop)
+                posix_fadvise(_fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(_fd);
+        }
+
+        bool ok() const { return _map->ok(); }
+
+        bool next(const uint8_t *&data, size_t &size) override
+        {
+            if (_offset >= _end)
+                return false;
+
+            data = _map->data() + _offset;
+            size = _end - _offset;
+            _offset = _end;
+            return true;
+        }
+
+        bool mapped() const override { return true; }
+        bool truncated() const override { return _map->truncated(); }
+
+    private:
+        int _fd;
+        std::unique_ptr<Mapping> _map;
+        size_t _offset;
+        size_t _end;
+        bool _drop;
+    };
+
+#ifdef SYNCOPY_URING
+    /**
+     * Minimal io_uring without liburing: one buffer per slot,
+     * slots are submitted in file order and returned in the same order.
+     */
+    class UringReader : public Reader
+    {
+    public:
+        UringReader(const Range &range, size_t block, unsigned depth)
+            : _range(range), _block(block), _slots(depth)
+        {
+        }
+
+        ~UringReader() override
+        {
+            // Buffers must outlive reads in flight
+            for (auto &slot : _slots) {
+                while (slot.busy && slot.result == Slot::pending) {
+                    if (!reap() && !enter(0, 1))
+                        break;
+                }
+            }
+
+            if (_sqes)
+                munmap(_sqes, _params.sq_entries * sizeof(io_uring_sqe));
+            if (_cq_ptr && _cq_ptr != _sq_ptr)
+                munmap(_cq_ptr, _cq_size);
+            if (_sq_ptr)
+                munmap(_sq_ptr, _sq_size);
+            if (_ring >= 0)
+                close(_ring);
+            _range.consumed(_range.start, _range.end - _range.start);
+            close(_range.fd);
+        }
+
+        bool init()
+        {
+            memset(&_params, 0, sizeof(_params));
+            _ring = syscall(__NR_io_uring_setup, _slots.size(), &_params);
+            if (_ring < 0)
+                return false;
+
+            _sq_size = _params.sq_off.array + _params.sq_entries * sizeof(unsigned);
+            _cq_size = _params.cq_off.cqes + _params.cq_entries * sizeof(io_uring_cqe);
+            if (_params.features & IORING_FEAT_SINGLE_MMAP)
+                _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+
+            _sq_ptr = map(_sq_size, IORING_OFF_SQ_RING);
+            if (!_sq_ptr)
+                return false;
+            _cq_ptr = _params.features & IORING_FEAT_SINGLE_MMAP ? _sq_ptr : map(_cq_size, IORING_OFF_CQ_RING);
+            if (!_cq_ptr)
+                return false;
+            _sqes = static_cast<io_uring_sqe *>(map(_params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+            if (!_sqes)
+                return false;
+
+            auto sq = static_cast<uint8_t *>(_sq_ptr);
+            _sq_tail = reinterpret_cast<unsigned *>(sq + _params.sq_off.tail);
+            _sq_mask = reinterpret_cast<unsigned *>(sq + _params.sq_off.ring_mask);
+            _sq_array = reinterpret_cast<unsigned *>(sq + _params.sq_off.array);
+            auto cq = static_cast<uint8_t *>(_cq_ptr);
+            _cq_head = reinterpret_cast<unsigned *>(cq + _params.cq_off.head);
+            _cq_tail = reinterpret_cast<unsigned *>(cq + _params.cq_off.tail);
+            _cq_mask = reinterpret_cast<unsigned *>(cq + _params.cq_off.ring_mask);
+            _cqes = reinterpret_cast<io_uring_cqe *>(cq + _params.cq_off.cqes);
+
+            for (auto &slot : _slots)
+                slot.buf = allocate(_block);
+
+            unsigned count = 0;
+            for (size_t i = 0; i < _slots.size(); ++i)
+                count += queue(i);
+
+            return count == 0 || enter(count, 0);
+        }
+
+        bool next(const uint8_t *&data, size_t &size) override
+        {
+            // The previous block is consumed, its slot reads ahead
+            if (_returned) {
+                _range.consumed(_slots[_head].offset, _slots[_head].size);
+                if (queue(_head) && !enter(1, 0))
+                    return false;
+                _head = (_head + 1) % _slots.size();
+                _returned = false;
+            }
+
+            auto &slot = _slots[_head];
+            if (!slot.busy)
+                return false;
+
+            while (slot.result == Slot::pending) {
+                if (!reap() && !enter(0, 1))
+                    return false;
+            }
+
+            slot.busy = false;
+            if (slot.result < 0)
+                return false;
+
+            // Short read, the rest is read synchronously to keep blocks in order
+            size_t done = slot.result;
+            while (done < slot.size) {
+                ssize_t n = pread(_range.fd, slot.buf.get() + done, slot.size - done, slot.offset + done);
+                if (n <= 0)
+                    break;
+                done += n;
+            }
+
+            if (!_range.trim(slot.buf.get(), slot.offset, done, data, size))
+                return false;
+
+            _returned = true;
+            return true;
+        }
+
+    private:
+        struct Slot
+        {
+            static const int64_t pending = INT64_MIN;
+
+            Buffer buf;
+            size_t offset = 0;
+            size_t size = 0;
+            int64_t result = pending;
+            bool busy = false;
+        };
+
+        void *map(size_t size, off_t offset)
+        {
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, offset);
+            return ptr != MAP_FAILED ? ptr : nullptr;
+        }
+
+        // Adds a read of the next block to the submission queue
+        bool queue(size_t i)
+        {
+            if (_range.pos >= _range.end)
+                return false;
+
+            auto &slot = _slots[i];
+            slot.offset = _range.pos;
+            slot.size = std::min(_block, _range.limit - _range.pos);
+            slot.result = Slot::pending;
+            slot.busy = true;
+            _range.pos += slot.size;
+
+            unsigned tail = *_sq_tail;
+            unsigned index = tail & *_sq_mask;
+            auto &sqe = _sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_READ;
+            sqe.fd = _range.fd;
+            sqe.addr = reinterpret_cast<uint64_t>(slot.buf.get());
+            sqe.len = slot.size;
+            sqe.off = slot.offset;
+            sqe.user_data = i;
+            _sq_array[index] = index;
+            __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        bool enter(unsigned submit, unsigned wait)
+        {
+            int ret = 0;
+            do {
+                ret = syscall(__NR_io_uring_enter, _ring, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            } while (ret < 0 && errno == EINTR);
+            return ret >= 0;
+        }
+
+        // Takes completed reads, returns false if there were none
+        bool reap()
+        {
+            unsigned head = *_cq_head;
+            unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail)
+                return false;
+
+            for (; head != tail; ++head) {
+                auto &cqe = _cqes[head & *_cq_mask];
+                _slots[cqe.user_data].result = cqe.res;
+            }
+            __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        Range _range;
+        int _ring = -1;
+        size_t _block;
+        std::vector<Slot> _slots;
+        size_t _head = 0;
+        bool _returned = false;
+
+        io_uring_params _params;
+        void *_sq_ptr = nullptr;
+        void *_cq_ptr = nullptr;
+        size_t _sq_size = 0;
+        size_t _cq_size = 0;
+        io_uring_sqe *_sqes = nullptr;
+        unsigned *_sq_tail = nullptr;
+        unsigned *_sq_mask = nullptr;
+        unsigned *_sq_array = nullptr;
+        unsigned *_cq_head = nullptr;
+        unsigned *_cq_tail = nullptr;
+        unsigned *_cq_mask = nullptr;
+        io_uring_cqe *_cqes = nullptr;
+    };
+#endif
+
+    std::unique_ptr<Reader> Reader::open(const std::string &path, size_t offset, size_t length)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return nullptr;
+        }
+
+        size_t size = st.st_size;
+        size_t end = length < size - std::min(offset, size) ? offset + length : size;
+        auto opts = options;
+        opts.depth = std::max(opts.depth, 1u);
+        bool drop = opts.cache != Cache::Keep;
+        if (opts.backend == Backend::Mmap) {
+            int dup_fd = dup(fd);
+            if (dup_fd >= 0) {
+                std::unique_ptr<MmapReader> r(new MmapReader(dup_fd, offset, end, drop));
+                if (r->ok()) {
+                    close(fd);
+                    return r;
+                }
+            }
+        }
+
+        // Big files do not go through the page cache at all
+        bool direct = false;
+        if (opts.cache == Cache::Direct && size >= opts.direct) {
+            int direct_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+            if (direct_fd >= 0) {
+                close(fd);
+                fd = direct_fd;
+                direct = true;
+            }
+        }
+
+        Range range(fd, offset, end, direct, drop);
+        // Buffers and slots of small ranges are not bigger than the range
+        size_t bytes = end - std::min(offset, end);
+        size_t blocks = (bytes + std::max<size_t>(opts.block, 1) - 1) / std::max<size_t>(opts.block, 1);
+        opts.block = std::min(opts.block, std::max<size_t>(bytes, 1) + ALIGN);
+        opts.block = (std::max<size_t>(opts.block, 1) + ALIGN - 1) / ALIGN * ALIGN;
+        opts.depth = std::max<unsigned>(1, std::min<size_t>(opts.depth, blocks));
+#ifdef SYNCOPY_URING
+        if ((opts.backend == Backend::Auto && blocks >= URING_BLOCKS) || opts.backend == Backend::Uring) {
+            int dup_fd = dup(fd);
+            if (dup_fd >= 0) {
+                Range dup_range = range;
+                dup_range.fd = dup_fd;
+                std::unique_ptr<UringReader> r(new UringReader(dup_range, opts.block, opts.depth));
+                if (r->init()) {
+                    close(fd);
+                    return r;
+                }
+            }
+        }
+#endif
+        if (!direct)
+            posix_fadvise(fd, offset, end - std::min(offset, end), POSIX_FADV_SEQUENTIAL);
+        return std::unique_ptr<Reader>(new PreadReader(range, opts.block));
+    }
+}
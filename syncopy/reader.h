@@ -0,0 +1,87 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+namespace syncopy
+{
+    /**
+     * Sequential reader of a file by big blocks.
+     * The io_uring backend keeps up to `depth` reads in flight ahead of the consumer,
+     * so reading overlaps with hashing. Falls back to pread if io_uring is not available.
+     * The mmap backend returns the whole mapped file at once.
+     *
+     * @example:
+     *  auto r = Reader::open(path);
+     *  const uint8_t *data = nullptr;
+     *  size_t size = 0;
+     *  while (r && r->next(data, size))
+     *      ...
+     */
+    class Reader
+    {
+    public:
+        enum class Backend
+        {
+            Auto,
+            Pread,
+            Uring,
+            // Whole file is mapped and returned as one block, never chosen by Auto.
+            // Truncating the file while it is read does not crash but fails the read, see Mapping.
+            Mmap
+        };
+
+        // How files read and written by syncopy use the page cache
+        enum class Cache
+        {
+            Keep,
+            // Pages are dropped after they are read or written back
+            DontNeed,
+            // Like DontNeed, files from `direct` bytes are read with O_DIRECT
+            Direct
+        };
+
+        struct Options
+        {
+            Backend backend = Backend::Auto;
+            size_t block = 1 << 20;
+            unsigned depth = 4;
+            Cache cache = Cache::Keep;
+            size_t direct = 64 << 20;
+        };
+
+        // Used by all readers of the process
+        static Options options;
+
+        /**
+         * Opens the file to read length bytes from offset.
+         * Returns nullptr if the file could not be opened.
+         */
+        static std::unique_ptr<Reader> open(const std::string &path, size_t offset = 0, size_t length = size_t(-1));
+
+        virtual ~Reader() = default;
+
+        /**
+         * Returns the next block, false at the end of the file.
+         * The data is valid until the next call.
+         */
+        virtual bool next(const uint8_t *&data, size_t &size) = 0;
+
+        /**
+         * True if blocks are contiguous in memory and stay valid until the reader is destroyed,
+         * so they can be used without copying.
+         */
+        virtual bool mapped() const { return false; }
+
+        /**
+         * True if the file was truncated while mapped blocks were read,
+         * the blocks have zeros instead of the missing data and must be dropped.
+         */
+        virtual bool truncated() const { return false; }
+    };
+}
@@ -0,0 +1,170 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "scanner.h"
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+namespace syncopy
+{
+    // Subdirs kept open to be read relative to their parents, the rest are opened by path
+    static const size_t MAX_OPEN_DIRS = 256;
+
+    struct Dirent64
+    {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    static bool stat(int dirfd, const char *name, Scanner::Entry &e)
+    {
+#ifdef STATX_BASIC_STATS
+        struct statx stx;
+        const unsigned mask = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO;
+        if (statx(dirfd, name, AT_NO_AUTOMOUNT, mask, &stx) != 0
+            && statx(dirfd, name, AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW, mask, &stx) != 0)
+            return false;
+
+        e.size = stx.stx_size;
+        e.mtime = stx.stx_mtime.tv_sec;
+        e.mtime_nsec = stx.stx_mtime.tv_nsec;
+        e.mode = stx.stx_mode;
+        e.inode = stx.stx_ino;
+#else
+        struct stat st;
+        if (fstatat(dirfd, name, &st, 0) != 0 && fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            return false;
+
+        e.size = st.st_size;
+        e.mtime = st.st_mtim.tv_sec;
+        e.mtime_nsec = st.st_mtim.tv_nsec;
+        e.mode = st.st_mode;
+        e.inode = st.st_ino;
+#endif
+        return true;
+    }
+
+    std::vector<Scanner::Entry> Scanner::scan(const std::string &dir) const
+    {
+        struct Dir
+        {
+            std::string path;
+            // -1 if the dir is opened by path
+            int fd;
+        };
+
+        std::vector<Entry> result;
+        std::deque<Dir> queue;
+        std::mutex mutex;
+        std::condition_variable cond;
+        // Dirs queued or being read
+        size_t pending = 1;
+        size_t opened = 0;
+        queue.push_back({dir, -1});
+
+        auto read = [&](const Dir &d, std::vector<Entry> &entries) {
+            int fd = d.fd >= 0 ? d.fd : open(d.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0)
+                return;
+
+            std::string prefix = d.path.empty() || d.path.back() == '/' ? d.path : d.path + "/";
+            std::vector<char> buf(1 << 16);
+            long n = 0;
+            while ((n = syscall(SYS_getdents64, fd, buf.data(), buf.size())) > 0) {
+                for (long pos = 0; pos < n;) {
+                    auto ent = reinterpret_cast<Dirent64 *>(buf.data() + pos);
+                    pos += ent->d_reclen;
+                    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                        continue;
+
+                    Entry e;
+                    if (!stat(fd, ent->d_name, e))
+                        continue;
+                    e.path = prefix + ent->d_name;
+
+                    // Symlinked dirs are not entered
+                    if (e.dir() && (ent->d_type == DT_DIR || ent->d_type == DT_UNKNOWN)) {
+                        int sub = -1;
+                        {
+                            std::lock_guard<std::mutex> locker(mutex);
+                            if (opened < MAX_OPEN_DIRS)
+                                ++opened;
+                            else
+                                sub = -2;
+                        }
+                        if (sub == -1) {
+                            sub = openat(fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                            if (sub < 0) {
+                                std::lock_guard<std::mutex> locker(mutex);
+                                --opened;
+                            }
+                        }
+
+                        // Not a dir anymore or a symlink found by DT_UNKNOWN
+                        if (sub < 0 && ent->d_type == DT_UNKNOWN) {
+                            struct stat st;
+                            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode)) {
+                                entries.push_back(std::move(e));
+                                continue;
+                            }
+                        }
+
+                        {
+                            std::lock_guard<std::mutex> locker(mutex);
+                            queue.push_back({e.path, sub >= 0 ? sub : -1});
+                            ++pending;
+                        }
+                        cond.notify_one();
+                    }
+
+                    entries.push_back(std::move(e));
+                }
+            }
+
+            close(fd);
+        };
+
+        auto worker = [&]() {
+            std::vector<Entry> entries;
+            std::unique_lock<std::mutex> locker(mutex);
+            while (true) {
+                cond.wait(locker, [&] { return !queue.empty() || pending == 0; });
+                if (queue.empty())
+                    break;
+
+                auto d = std::move(queue.front());
+                queue.pop_front();
+                if (d.fd >= 0)
+                    --opened;
+                locker.unlock();
+                read(d, entries);
+                locker.lock();
+                if (--pending == 0)
+                    cond.notify_all();
+            }
+
+            result.insert(result.end(), std::make_move_iterator(entries.begin()), std::make_move_iterator(entries.end()));
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < _threads; ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (auto &t : threads)
+            t.join();
+
+        return result;
+    }
+}
@@ -0,0 +1,53 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace syncopy
+{
+    /**
+     * Collects metadata of a whole tree.
+     * Directories are read by a pool of threads, entries are stat'ed relative to the fd of their directory,
+     * so each entry costs one statx call without resolving its path again.
+     * Paths are prefixed by the scanned dir, like File::files() does.
+     *
+     * @example:
+     *  Scanner scanner(8);
+     *  for (auto &e : scanner.scan("."))
+     *      if (!e.dir())
+     *          std::cout << e.path << " " << e.size << std::endl;
+     */
+    class Scanner
+    {
+    public:
+        struct Entry
+        {
+            std::string path;
+            size_t size = 0;
+            time_t mtime = 0;
+            long mtime_nsec = 0;
+            mode_t mode = 0;
+            uint64_t inode = 0;
+
+            bool dir() const { return S_ISDIR(mode); }
+        };
+
+        explicit Scanner(size_t threads = 4) : _threads(threads > 0 ? threads : 1) {}
+
+        /**
+         * Returns all files and dirs under dir, not including dir itself.
+         * Symlinks are followed for metadata, symlinked dirs are listed but not entered.
+         */
+        std::vector<Entry> scan(const std::string &dir) const;
+
+    private:
+        size_t _threads;
+    };
+}
@@ -0,0 +1,256 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <set>
+#include <map>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+namespace syncopy
+{
+    /**
+     * Distributes files between workers.
+     * Each worker has own queue and takes the smallest file first,
+     * a worker without files steals the biggest one from other queues,
+     * so a huge file does not hold up thousands of small ones.
+     * A path is queued only once, a path changed while it is being
+     * processed is cancelled and queued again when the worker is done.
+     * States of paths are sharded by path and queues have own locks, so workers do not
+     * contend on one lock; the global one is taken only to sleep while there is no work.
+     *
+     * @example:
+     *  Scheduler::Job job;
+     *  while (scheduler.pop(worker, job)) {
+     *      ... if (scheduler.cancelled(job)) ...
+     *      scheduler.done(job);
+     *  }
+     */
+    class Scheduler
+    {
+    public:
+        struct Job
+        {
+            std::string path;
+            size_t size = 0;
+            time_t mtime = 0;
+            uint64_t version = 0;
+        };
+
+        explicit Scheduler(size_t workers) : _queues(std::max<size_t>(1, workers))
+        {
+        }
+
+        void push(const std::string &path, size_t size, time_t mtime)
+        {
+            auto &shard = this->shard(path);
+            std::lock_guard<std::mutex> locker(shard.mutex);
+            auto &state = shard.states[path];
+            if (state.version != 0 && state.size == size && state.mtime == mtime)
+                return;
+
+            // The entry of the old version is not taken anymore
+            if (state.version != 0 && !state.running)
+                dequeue(path, state);
+
+            state.size = size;
+            state.mtime = mtime;
+            state.version = ++_version;
+            // Will be queued again by done()
+            if (state.running)
+                return;
+
+            enqueue(path, state);
+        }
+
+        /**
+         * Waits for a job for the worker.
+         * Returns false if stopped.
+         */
+        bool pop(size_t worker, Job &job)
+        {
+            worker %= _queues.size();
+            while (!_stopped) {
+                Entry e;
+                if (!take(worker, e)) {
+                    wait();
+                    continue;
+                }
+
+                auto &shard = this->shard(e.path);
+                std::lock_guard<std::mutex> locker(shard.mutex);
+                auto it = shard.states.find(e.path);
+                // Outdated entry, the path was queued again
+                if (it == shard.states.end() || it->second.version != e.version || it->second.running)
+                    continue;
+
+                it->second.running = true;
+                job = {e.path, it->second.size, it->second.mtime, e.version};
+                return true;
+            }
+
+            return false;
+        }
+
+        /**
+         * True if the path of the job has been changed since it was taken.
+         */
+        bool cancelled(const Job &job) const
+        {
+            if (_stopped)
+                return true;
+
+            auto &shard = this->shard(job.path);
+            std::lock_guard<std::mutex> locker(shard.mutex);
+            auto it = shard.states.find(job.path);
+            return it == shard.states.end() || it->second.version != job.version;
+        }
+
+        void done(const Job &job)
+        {
+            auto &shard = this->shard(job.path);
+            std::lock_guard<std::mutex> locker(shard.mutex);
+            auto it = shard.states.find(job.path);
+            if (it == shard.states.end())
+                return;
+
+            it->second.running = false;
+            if (it->second.version != job.version)
+                enqueue(job.path, it->second);
+            else
+                shard.states.erase(it);
+        }
+
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> locker(_mutex);
+                _stopped = true;
+            }
+            _cv.notify_all();
+        }
+
+        // Number of paths queued or being processed
+        size_t size() const
+        {
+            size_t result = 0;
+            for (auto &shard : _shards) {
+                std::lock_guard<std::mutex> locker(shard.mutex);
+                result += shard.states.size();
+            }
+            return result;
+        }
+
+    private:
+        static const size_t SHARDS = 16;
+
+        struct State
+        {
+            size_t size = 0;
+            time_t mtime = 0;
+            uint64_t version = 0;
+            // Queue of the entry while it is queued
+            size_t queue = 0;
+            bool running = false;
+        };
+
+        struct Entry
+        {
+            size_t size = 0;
+            uint64_t version = 0;
+            std::string path;
+
+            bool operator<(const Entry &other) const
+            {
+                return size != other.size ? size < other.size : version < other.version;
+            }
+        };
+
+        struct Queue
+        {
+            std::mutex mutex;
+            std::set<Entry> entries;
+        };
+
+        struct Shard
+        {
+            mutable std::mutex mutex;
+            std::map<std::string, State> states;
+        };
+
+        Shard &shard(const std::string &path) { return _shards[std::hash<std::string>()(path) % SHARDS]; }
+        const Shard &shard(const std::string &path) const { return _shards[std::hash<std::string>()(path) % SHARDS]; }
+
+        // Must be called under the lock of the shard of the path
+        void enqueue(const std::string &path, State &state)
+        {
+            state.queue = _next++ % _queues.size();
+            auto &q = _queues[state.queue];
+            {
+                std::lock_guard<std::mutex> locker(q.mutex);
+                q.entries.insert({state.size, state.version, path});
+            }
+            ++_queued;
+            // Sleeping workers are woken under the global lock, so they cannot miss the entry
+            if (_sleeping > 0) {
+                std::lock_guard<std::mutex> locker(_mutex);
+                _cv.notify_one();
+            }
+        }
+
+        // Must be called under the lock of the shard of the path
+        void dequeue(const std::string &path, const State &state)
+        {
+            auto &q = _queues[state.queue];
+            std::lock_guard<std::mutex> locker(q.mutex);
+            if (q.entries.erase({state.size, state.version, path}) > 0)
+                --_queued;
+        }
+
+        bool take(size_t worker, Entry &e)
+        {
+            for (size_t i = 0; i < _queues.size(); ++i) {
+                auto &q = _queues[(worker + i) % _queues.size()];
+                std::lock_guard<std::mutex> locker(q.mutex);
+                if (q.entries.empty())
+                    continue;
+
+                // Own queue: the smallest file, stolen: the biggest one
+                auto it = i == 0 ? q.entries.begin() : std::prev(q.entries.end());
+                e = *it;
+                q.entries.erase(it);
+                --_queued;
+                return true;
+            }
+
+            return false;
+        }
+
+        void wait()
+        {
+            std::unique_lock<std::mutex> locker(_mutex);
+            ++_sleeping;
+            _cv.wait(locker, [&] { return _queued > 0 || _stopped; });
+            --_sleeping;
+        }
+
+        std::vector<Queue> _queues;
+        Shard _shards[SHARDS];
+        std::atomic<size_t> _queued = {0};
+        std::atomic<uint64_t> _version = {0};
+        std::atomic<size_t> _next = {0};
+        std::atomic<bool> _stopped = {false};
+        // Workers sleep under _mutex only while all queues are empty
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::atomic<size_t> _sleeping = {0};
+    };
+}
@@ -5,18 +5,32 @@
 #pragma once
 
 #include "checksum.h"
+#include "arena.h"
 #include <string>
 #include <map>
 #include <cstdint>
 #include <fstream>
 #include <vector>
+#include <array>
 #include <sys/stat.h>
 
 static const std::string SIGNATURE_HEADER = "syncopy::signature";
-static const std::string DELTA_HEADER = "syncopy::delta";
+// Literal bytes follow all chunks since delta2, older deltas are rejected
+static const std::string DELTA_HEADER = "syncopy::delta2";
 
 namespace syncopy
 {
+    // Bytes of the stream not read yet, 0 if the stream cannot tell
+    inline size_t unread(std::istream &is)
+    {
+        auto pos = is.tellg();
+        if (pos < 0 || !is.seekg(0, std::ios::end))
+            return 0;
+        auto end = is.tellg();
+        is.seekg(pos);
+        return end > pos ? size_t(end - pos) : 0;
+    }
+
     class Signature
     {
 
@@ -60,6 +74,21 @@ namespace syncopy
             }
         };
 
+        /**
+         * Range of zeros which is not hashed, like a hole of a sparse file.
+         * Chunks and holes together cover the file.
+         */
+        struct Hole
+        {
+            size_t pos = 0;
+            size_t size = 0;
+
+            bool operator==(const Hole &other) const
+            {
+                return pos == other.pos && size == other.size;
+            }
+        };
+
         void serialize(std::ostream& os) const
         {
             os.write(SIGNATURE_HEADER.c_str(), SIGNATURE_HEADER.size());
@@ -68,6 +97,12 @@ namespace syncopy
             os.write(reinterpret_cast<const char *>(&size), sizeof(size));
             for (auto &a : chunks)
                 a.serialize(os);
+            size = holes.size();
+            os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+            for (auto &h : holes) {
+                os.write(reinterpret_cast<const char *>(&h.pos), sizeof(h.pos));
+                os.write(reinterpret_cast<const char *>(&h.size), sizeof(h.size));
+            }
         }
 
         bool deserialize(std::istream& os)
@@ -85,6 +120,15 @@ namespace syncopy
                 c.deserialize(os);
                 chunks.push_back(c);
             }
+            // Missing in signatures saved before holes were known
+            size = 0;
+            os.read(reinterpret_cast<char *>(&size), sizeof(size));
+            for (size_t i = 0; i < size && os; ++i) {
+                Hole h;
+                os.read(reinterpret_cast<char *>(&h.pos), sizeof(h.pos));
+                os.read(reinterpret_cast<char *>(&h.size), sizeof(h.size));
+                holes.push_back(h);
+            }
 
             return true;
         }
@@ -103,60 +147,172 @@ namespace syncopy
 
         bool operator==(const Signature &other) const
         {
-            return window == other.window && chunks == other.chunks;
+            return window == other.window && chunks == other.chunks && holes == other.holes;
         }
 
         uint32_t window = 0;
         std::vector<Chunk> chunks;
+        std::vector<Hole> holes;
     };
 
     class Delta
     {
     public:
+        /**
+         * View of literal bytes, owned by the arena of the delta.
+         */
+        struct Bytes
+        {
+            Bytes() = default;
+            Bytes(const uint8_t *begin, const uint8_t *end) : ptr(begin), len(end - begin) {}
+
+            const uint8_t *data() const { return ptr; }
+            size_t size() const { return len; }
+            bool empty() const { return len == 0; }
+            const uint8_t *begin() const { return ptr; }
+            const uint8_t *end() const { return ptr + len; }
+            uint8_t operator[](size_t i) const { return ptr[i]; }
+
+            bool operator==(const Bytes &other) const
+            {
+                return len == other.len && (len == 0 || memcmp(ptr, other.ptr, len) == 0);
+            }
+
+            const uint8_t *ptr = nullptr;
+            size_t len = 0;
+        };
+
+        /**
+         * Literal data or a copy of size bytes from src_pos of the destination file.
+         * Non empty path means copying from another file of the destination tree.
+         * Output means copying bytes the patch has already written at src_pos, like repeated records.
+         * Without data and src_pos it is a run of size zeros.
+         */
         struct Chunk
         {
             size_t src_pos = -1;
             size_t dst_pos = 0;
-            std::vector<uint8_t> data;
+            Bytes data;
             size_t size = 0;
+            std::string path;
+            bool output = false;
 
             Chunk() = default;
-            Chunk(size_t src_pos, size_t dst_pos, const std::vector<uint8_t> &data, size_t size)
-                : src_pos(src_pos), dst_pos(dst_pos), data(data), size(size)
+            Chunk(size_t src_pos, size_t dst_pos, Bytes data, size_t size, const std::string &path = {})
+                : src_pos(src_pos), dst_pos(dst_pos), data(data), size(size), path(path)
             {}
 
             bool operator==(const Chunk &other) const
             {
-                return src_pos == other.src_pos && dst_pos == other.dst_pos && data == other.data && size == other.size;
+                return src_pos == other.src_pos && dst_pos == other.dst_pos && data == other.data && size == other.size
+                    && path == other.path && output == other.output;
+            }
+
+            bool zero() const
+            {
+                return src_pos == size_t(-1) && data.empty() && path.empty();
             }
 
+            // Literal bytes are written after all chunks
             void serialize(std::ostream& os) const
             {
                 os.write(reinterpret_cast<const char *>(&src_pos), sizeof(src_pos));
                 os.write(reinterpret_cast<const char *>(&dst_pos), sizeof(dst_pos));
                 size_t data_size = data.size();
                 os.write(reinterpret_cast<const char *>(&data_size), sizeof(data_size));
-                os.write(reinterpret_cast<const char *>(data.data()), data.size());
                 os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+                size_t path_size = path.size();
+                os.write(reinterpret_cast<const char *>(&path_size), sizeof(path_size));
+                os.write(path.c_str(), path_size);
+                os.write(reinterpret_cast<const char *>(&output), sizeof(output));
             }
 
+            // Only the size of literal bytes is read, Delta points data to them
             void deserialize(std::istream& os)
             {
                 os.read(reinterpret_cast<char *>(&src_pos), sizeof(src_pos));
                 os.read(reinterpret_cast<char *>(&dst_pos), sizeof(dst_pos));
                 size_t data_size = 0;
                 os.read(reinterpret_cast<char *>(&data_size), sizeof(data_size));
-                data.resize(data_size);
-                os.read(reinterpret_cast<char *>(data.data()), data_size);
+                data.ptr = nullptr;
+                data.len = data_size;
                 os.read(reinterpret_cast<char *>(&size), sizeof(size));
+                size_t path_size = 0;
+                os.read(reinterpret_cast<char *>(&path_size), sizeof(path_size));
+                if (path_size > 0 && path_size > unread(os)) {
+                    os.setstate(std::ios::failbit);
+                    return;
+                }
+                path.resize(path_size);
+                os.read(path.data(), path_size);
+                os.read(reinterpret_cast<char *>(&output), sizeof(output));
             }
         };
 
+        Delta() = default;
+        Delta(Delta &&) = default;
+        Delta &operator=(Delta &&) = default;
+
+        // Literal bytes are copied to the arena of the copy
+        Delta(const Delta &other)
+        {
+            *this = other;
+        }
+
+        Delta &operator=(const Delta &other)
+        {
+            if (this == &other)
+                return *this;
+
+            st = other.st;
+            md5 = other.md5;
+            segments = other.segments;
+            chunks = other.chunks;
+            literals.clear();
+            for (auto &c : chunks) {
+                auto ptr = literals.append(c.data.data(), c.data.size());
+                c.data = {ptr, ptr + c.data.size()};
+            }
+
+            return *this;
+        }
+
         bool operator==(const Delta &other) const
         {
             return md5 == other.md5 && chunks == other.chunks;
         }
 
+        // Adds a chunk of literal data, the data is copied once to the arena
+        void literal(size_t dst_pos, const uint8_t *data, size_t size)
+        {
+            auto ptr = literals.append(data, size);
+            chunks.emplace_back(size_t(-1), dst_pos, Bytes{ptr, ptr + size}, size);
+        }
+
+        // Adds a copy of the output written before, joined with the previous copy if it continues it
+        // and the joined copy still ends before its destination
+        void repeat(size_t src_pos, size_t dst_pos, size_t size)
+        {
+            if (!chunks.empty()) {
+                auto &last = chunks.back();
+                if (last.output && last.src_pos + last.size == src_pos && last.dst_pos + last.size == dst_pos &&
+                    last.src_pos + last.size + size <= last.dst_pos) {
+                    last.size += size;
+                    return;
+                }
+            }
+
+            chunks.emplace_back(src_pos, dst_pos, Bytes{}, size);
+            chunks.back().output = true;
+        }
+
+        // Drops all chunks, the arena keeps its memory for next chunks
+        void clear()
+        {
+            chunks.clear();
+            literals.clear();
+        }
+
         void serialize(std::ostream& os) const
         {
             os.write(DELTA_HEADER.c_str(), DELTA_HEADER.size());
@@ -168,6 +324,11 @@ namespace syncopy
             os.write(reinterpret_cast<const char *>(&size), sizeof(size));
             for (auto &a : chunks)
                 a.serialize(os);
+            for (auto &a : chunks)
+                os.write(reinterpret_cast<const char *>(a.data.data()), a.data.size());
+            size = segments.size();
+            os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+            os.write(reinterpret_cast<const char *>(segments.data()), size * sizeof(Digest));
         }
 
         bool deserialize(std::istream& os)
@@ -180,17 +341,46 @@ namespace syncopy
             os.read(reinterpret_cast<char *>(&st), sizeof(st));
             size_t size = 0;
             os.read(reinterpret_cast<char *>(&size), sizeof(size));
+            if (!os || size > MD5_DIGEST_LENGTH * 2)
+                return false;
             md5.resize(size);
             os.read(md5.data(), md5.size());
             size = 0;
             os.read(reinterpret_cast<char *>(&size), sizeof(size));
-            for (size_t i = 0; i < size; ++i) {
-                Chunk c;
-                c.deserialize(os);
-                chunks.push_back(c);
+            // A corrupted count or size must not allocate more than the stream could have
+            if (!os || size > unread(os) / (sizeof(Chunk::src_pos) * 5))
+                return false;
+            chunks.clear();
+            chunks.reserve(size);
+            size_t total = 0;
+            for (size_t i = 0; i < size && os; ++i) {
+                chunks.emplace_back();
+                chunks.back().deserialize(os);
+                if (chunks.back().data.size() > SIZE_MAX - total)
+                    return false;
+                total += chunks.back().data.size();
+            }
+            if (!os || total > unread(os))
+                return false;
+
+            // All literals are read by one call to one allocation
+            literals.clear();
+            auto ptr = total > 0 ? literals.allocate(total) : nullptr;
+            os.read(reinterpret_cast<char *>(ptr), total);
+            for (auto &c : chunks) {
+                c.data.ptr = c.data.empty() ? nullptr : ptr;
+                ptr += c.data.size();
             }
 
-            return true;
+            segments.clear();
+            size = 0;
+            os.read(reinterpret_cast<char *>(&size), sizeof(size));
+            if (!os || size > unread(os) / sizeof(Digest))
+                return false;
+            segments.resize(size);
+            os.read(reinterpret_cast<char *>(segments.data()), segments.size() * sizeof(Digest));
+
+            return bool(os);
         }
 
         void save(const std::string &path)
@@ -205,9 +395,17 @@ namespace syncopy
             return deserialize(f);
         }
 
+        // Bytes of the result hashed separately, so a parallel patch verifies them in any order
+        static const size_t SEGMENT = 4 << 20;
+        using Digest = std::array<uint8_t, MD5_DIGEST_LENGTH>;
+
         struct stat st;
         std::string md5;
+        // md5 of every SEGMENT bytes of the result, empty if they are not known
+        std::vector<Digest> segments;
         std::vector<Chunk> chunks;
+        // Storage of literal data of chunks
+        Arena literals;
     };
 }
 
@@ -0,0 +1,193 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+
+namespace syncopy
+{
+    std::atomic<bool> Trace::_enabled = {false};
+
+    namespace
+    {
+        // Events of one thread, locked by its owner only while dumping
+        struct Ring
+        {
+            std::mutex mutex;
+            std::vector<Trace::Event> events;
+            size_t next = 0;
+            bool full = false;
+            uint32_t tid = 0;
+            std::string name;
+        };
+
+        struct Rings
+        {
+            std::mutex mutex;
+            // Rings of finished threads are kept for the dump
+            std::vector<std::shared_ptr<Ring>> rings;
+            size_t capacity = 0;
+            std::string process;
+        };
+
+        Rings &rings()
+        {
+            // Never destroyed, threads may record while the process exits
+            static Rings *result = new Rings;
+            return *result;
+        }
+
+        Ring &ring()
+        {
+            thread_local std::shared_ptr<Ring> result;
+            if (!result) {
+                result = std::make_shared<Ring>();
+                auto &all = rings();
+                std::lock_guard<std::mutex> locker(all.mutex);
+                result->tid = all.rings.size() + 1;
+                result->events.resize(all.capacity);
+                all.rings.push_back(result);
+            }
+
+            return *result;
+        }
+
+        std::string escape(const std::string &str)
+        {
+            std::string result;
+            for (unsigned char c : str) {
+                if (c == '"' || c == '\\') {
+                    result += '\\';
+                    result += c;
+                } else if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    result += buf;
+                } else {
+                    result += c;
+                }
+            }
+
+            return result;
+        }
+    }
+
+    void Trace::enable(size_t capacity)
+    {
+        auto &all = rings();
+        {
+            std::lock_guard<std::mutex> locker(all.mutex);
+            all.capacity = std::max<size_t>(1, capacity);
+        }
+        _enabled = true;
+    }
+
+    void Trace::process(const std::string &name)
+    {
+        auto &all = rings();
+        std::lock_guard<std::mutex> locker(all.mutex);
+        all.process = name;
+    }
+
+    void Trace::thread(const std::string &name)
+    {
+        if (!enabled())
+            return;
+        auto &r = ring();
+        std::lock_guard<std::mutex> locker(r.mutex);
+        r.name = name;
+    }
+
+    void Trace::record(Event &&e)
+    {
+        auto &r = ring();
+        std::lock_guard<std::mutex> locker(r.mutex);
+        if (r.events.empty())
+            return;
+        e.tid = r.tid;
+        r.events[r.next] = std::move(e);
+        if (++r.next == r.events.size()) {
+            r.next = 0;
+            r.full = true;
+        }
+    }
+
+    std::vector<Trace::Event> Trace::events()
+    {
+        std::vector<Event> result;
+        auto &all = rings();
+        std::lock_guard<std::mutex> locker(all.mutex);
+        for (auto &r : all.rings) {
+            std::lock_guard<std::mutex> ring_locker(r->mutex);
+            size_t count = r->full ? r->events.size() : r->next;
+            result.insert(result.end(), r->events.begin(), r->events.begin() + count);
+        }
+
+        // Enclosing spans first
+        std::sort(result.begin(), result.end(), [](const Event &a, const Event &b) {
+            return a.ts != b.ts ? a.ts < b.ts : a.dur > b.dur;
+        });
+        return result;
+    }
+
+    bool Trace::dump(const std::string &path)
+    {
+        auto tmp = path + ".tmp";
+        auto pid = getpid();
+        {
+            std::ofstream f(tmp, std::ios::out | std::ios::trunc);
+            f << "{\"traceEvents\":[\n";
+            bool first = true;
+            auto comma = [&]() -> std::ofstream & {
+                if (!first)
+                    f << ",\n";
+                first = false;
+                return f;
+            };
+
+            {
+                auto &all = rings();
+                std::lock_guard<std::mutex> locker(all.mutex);
+                if (!all.process.empty()) {
+                    comma() << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" << pid
+                            << ",\"args\":{\"name\":\"" << escape(all.process) << "\"}}";
+                }
+                for (auto &r : all.rings) {
+                    std::lock_guard<std::mutex> ring_locker(r->mutex);
+                    if (r->name.empty())
+                        continue;
+                    comma() << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid << ",\"tid\":" << r->tid
+                            << ",\"args\":{\"name\":\"" << escape(r->name) << "\"}}";
+                }
+            }
+
+            for (auto &e : events()) {
+                comma() << "{\"ph\":\"X\",\"name\":\"" << escape(e.name) << "\",\"cat\":\"" << e.cat
+                        << "\",\"pid\":" << pid << ",\"tid\":" << e.tid << ",\"ts\":" << e.ts << ",\"dur\":" << e.dur;
+                if (!e.arg.empty())
+                    f << ",\"args\":{\"arg\":\"" << escape(e.arg) << "\"}";
+                f << "}";
+            }
+            f << "\n]}\n";
+
+            if (!f.good()) {
+                std::cerr << "Could not write trace: " << tmp << std::endl;
+                return false;
+            }
+        }
+
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::cerr << "Could not write trace: " << path << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+}
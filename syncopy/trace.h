@@ -0,0 +1,100 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace syncopy
+{
+    /**
+     * Timeline of the process in the Chrome trace format, opened by chrome://tracing or Perfetto.
+     * Spans are kept in a ring of every thread, the oldest ones are overwritten,
+     * nothing is recorded until tracing is enabled.
+     * Timestamps are of the monotonic clock, so traces of processes on one host may be loaded together.
+     *
+     * @example:
+     *  Trace::enable();
+     *  Trace::thread("worker 1");
+     *  {
+     *      Span span("delta", path);
+     *      ...
+     *  }
+     *  Trace::dump("client.json");
+     */
+    class Trace
+    {
+    public:
+        struct Event
+        {
+            std::string name;
+            std::string arg;
+            const char *cat = "";
+            // Microseconds
+            int64_t ts = 0;
+            int64_t dur = 0;
+            uint32_t tid = 0;
+        };
+
+        // Spans kept by every thread
+        static void enable(size_t capacity = 1 << 16);
+        static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+
+        // Names of the process and of the calling thread in the timeline
+        static void process(const std::string &name);
+        static void thread(const std::string &name);
+
+        static void record(Event &&e);
+        // Recorded spans of all threads ordered by time
+        static std::vector<Event> events();
+        // Writes the JSON to a temporary file renamed to path
+        static bool dump(const std::string &path);
+
+        static int64_t now()
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+    private:
+        static std::atomic<bool> _enabled;
+    };
+
+    /**
+     * Records its scope as a complete event, costs a load of a flag when tracing is disabled.
+     */
+    class Span
+    {
+    public:
+        explicit Span(const std::string &name, const std::string &arg = {}, const char *cat = "syncopy")
+        {
+            if (!Trace::enabled())
+                return;
+            _e.name = name;
+            _e.arg = arg;
+            _e.cat = cat;
+            _e.ts = Trace::now();
+            _active = true;
+        }
+
+        ~Span()
+        {
+            if (!_active)
+                return;
+            _e.dur = Trace::now() - _e.ts;
+            Trace::record(std::move(_e));
+        }
+
+        Span(const Span &) = delete;
+        Span &operator=(const Span &) = delete;
+
+    private:
+        Trace::Event _e;
+        bool _active = false;
+    };
+}
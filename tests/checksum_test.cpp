@@ -170,4 +170,85 @@ TEST(Checksum, adler32)
     a.update(0, 49);
     EXPECT_EQ(a.hash(), 655361);
     EXPECT_EQ(a.hash(), b.hash());
-}
\ No newline at end of file
+}
+TEST(Checksum, adler32_rolling)
+{
+    // Windows where the byte going out is bigger than sum1 of the window
+    std::vector<uint8_t> bytes(20000);
+    uint32_t seed = 1;
+    for (auto &b : bytes)
+        b = (seed = seed * 1103515245 + 12345) >> 16;
+
+    const uint32_t window = 1000;
+    syncopy::checksum::Adler32 a(window);
+    for (size_t i = 0; i < window; ++i)
+        a.eat(bytes[i]);
+    for (size_t i = window; i < bytes.size(); ++i) {
+        a.update(bytes[i], bytes[i - window]);
+        syncopy::checksum::Adler32 b(window);
+        for (size_t k = i + 1 - window; k <= i; ++k)
+            b.eat(bytes[k]);
+        ASSERT_EQ(a.hash(), b.hash()) << "at " << i;
+    }
+}
+TEST(Checksum, adler32_fixed)
+{
+    std::vector<uint8_t> bytes(20000);
+    uint32_t seed = 7;
+    for (auto &b : bytes)
+        b = (seed = seed * 1103515245 + 12345) >> 16;
+
+    const uint32_t window = 1024;
+    syncopy::checksum::BasicAdler32<window> a;
+    syncopy::checksum::Adler32 b(window);
+    EXPECT_EQ(a.window(), b.window());
+    for (size_t i = 0; i < window; ++i) {
+        a.eat(bytes[i]);
+        b.eat(bytes[i]);
+    }
+    EXPECT_EQ(a.hash(), b.hash());
+    for (size_t i = window; i < bytes.size(); ++i) {
+        a.update(bytes[i], bytes[i - window]);
+        b.update(bytes[i], bytes[i - window]);
+        ASSERT_EQ(a.hash(), b.hash()) << "at " << i;
+    }
+
+    // Bulk eating reduces sums less often
+    syncopy::checksum::Adler32 c(bytes.size());
+    c.eat(bytes.data(), bytes.size());
+    b = syncopy::checksum::Adler32(bytes.size());
+    for (auto byte : bytes)
+        b.eat(byte);
+    EXPECT_EQ(c.hash(), b.hash());
+}
+TEST(Checksum, rolling64)
+{
+    std::vector<uint8_t> bytes(20000);
+    uint32_t seed = 3;
+    for (auto &b : bytes)
+        b = (seed = seed * 1103515245 + 12345) >> 16;
+
+    const uint32_t window = 1000;
+    syncopy::checksum::Rolling64 a(window);
+    syncopy::checksum::BasicRolling64<window> fixed;
+    a.eat(bytes.data(), window);
+    for (size_t i = 0; i < window; ++i)
+        fixed.eat(bytes[i]);
+    EXPECT_EQ(a.hash(), fixed.hash());
+    for (size_t i = window; i < bytes.size(); ++i) {
+        a.update(bytes[i], bytes[i - window]);
+        fixed.update(bytes[i], bytes[i - window]);
+        syncopy::checksum::Rolling64 b(window);
+        b.eat(&bytes[i + 1 - window], window);
+        ASSERT_EQ(a.hash(), b.hash()) << "at " << i;
+        ASSERT_EQ(fixed.hash(), b.hash()) << "at " << i;
+        ASSERT_EQ(a.adler32(), uint32_t(b.hash() >> 32));
+    }
+
+    // Windows of the same bytes in another order
+    syncopy::checksum::Rolling64 x(4);
+    syncopy::checksum::Rolling64 y(4);
+    x.eat(reinterpret_cast<const uint8_t *>("abcd"), 4);
+    y.eat(reinterpret_cast<const uint8_t *>("bacd"), 4);
+    EXPECT_NE(x.hash(), y.hash());
+}
@@ -3,6 +3,7 @@
  *********************************************************/
 
 #include "file.h"
+#include "hashcache.h"
 #include <gtest/gtest.h>
 #include <fstream>
 
@@ -18,6 +19,9 @@ TEST(File, create)
     v.push_back(5);
     EXPECT_EQ(f.size(), 5);
     EXPECT_EQ(f.readAll(), v);
+    EXPECT_EQ(f.read(1, 3), std::vector<uint8_t>({2,3,4}));
+    EXPECT_EQ(f.read(3, 10), std::vector<uint8_t>({4,5}));
+    EXPECT_TRUE(f.read(10, 1).empty());
     f.write({});
     EXPECT_EQ(f.size(), 0);
     f.remove();
@@ -612,6 +616,12 @@ TEST(Signature, serialize)
     }
     EXPECT_EQ(delta, delta2);
 
+    // Literals of a copy do not point to the arena of the original
+    auto copy = std::make_unique<syncopy::Delta>(delta2);
+    delta2.clear();
+    EXPECT_EQ(delta, *copy);
+    EXPECT_NE(copy->chunks[0].data.data(), delta.chunks[0].data.data());
+
     dst.remove();
     src.remove();
 }
@@ -686,4 +696,475 @@ TEST(File, list)
 {
     auto files = syncopy::File::files(".");
     EXPECT_TRUE(files.size() > 0);
-}
\ No newline at end of file
+}
+
+TEST(File, sig_windows)
+{
+    syncopy::File f("/tmp/sig_windows");
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 103; ++i)
+        bytes.push_back(i % 7);
+    f.write(bytes);
+
+    auto sig = f.signature(10);
+    syncopy::Signature sig2;
+    sig2.window = 10;
+    for (size_t offset = 0;;) {
+        auto part = f.signature(10, offset, 3);
+        if (part.chunks.empty())
+            break;
+        offset += part.chunks.size() * part.window;
+        sig2.chunks.insert(sig2.chunks.end(), part.chunks.begin(), part.chunks.end());
+    }
+
+    EXPECT_EQ(sig, sig2);
+
+    f.remove();
+}
+
+TEST(File, delta_window_zero)
+{
+    syncopy::File dst("/tmp/delta_window_zero1");
+    syncopy::File src("/tmp/delta_window_zero2");
+    std::vector<uint8_t> bytes(200000);
+    for (size_t i = 0; i < bytes.size(); ++i)
+        bytes[i] = i * 31;
+    src.write(bytes);
+    dst.write({});
+
+    // Nothing to match, the whole file is literal
+    auto delta = src.delta(syncopy::Signature{});
+    size_t literal = 0;
+    for (auto &chunk : delta.chunks)
+        literal += chunk.data.size();
+    EXPECT_EQ(literal, bytes.size());
+    EXPECT_EQ(delta.md5, src.md5());
+    EXPECT_TRUE(dst.patch(delta));
+    EXPECT_EQ(dst.readAll(), bytes);
+
+    dst.remove();
+    src.remove();
+}
+
+TEST(File, delta_windows)
+{
+    syncopy::File dst("/tmp/delta_windows1");
+    syncopy::File src("/tmp/delta_windows2");
+
+    std::vector<uint8_t> bytes(50000);
+    uint32_t seed = 1;
+    for (auto &b : bytes)
+        b = (seed = seed * 1103515245 + 12345) >> 16;
+    dst.write(bytes);
+    bytes.insert(bytes.begin() + 12345, 777, 'x');
+    bytes.erase(bytes.begin() + 30000, bytes.begin() + 31000);
+    src.write(bytes);
+
+    // Specialized and generic kernels
+    for (uint32_t window : {512, 1000, 1024, 2048, 4096, 8192, 999, 3000}) {
+        auto sig = dst.compactSignature(window);
+        EXPECT_EQ(sig.window, window);
+
+        auto delta = src.delta(sig, size_t(-1), {});
+        size_t matched = 0;
+        for (auto &chunk : delta.chunks)
+            matched += chunk.data.empty() ? chunk.size : 0;
+        EXPECT_GT(matched, bytes.size() / 2) << window;
+
+        syncopy::File copy("/tmp/delta_windows3");
+        copy.write(dst.readAll());
+        EXPECT_TRUE(copy.patch(delta)) << window;
+        EXPECT_EQ(copy.readAll(), bytes) << window;
+        copy.remove();
+    }
+
+    dst.remove();
+    src.remove();
+}
+
+TEST(File, delta_repeated)
+{
+    syncopy::File dst("/tmp/delta_repeated1");
+    syncopy::File src("/tmp/delta_repeated2");
+
+    uint32_t seed = 1;
+    auto random = [&](size_t size) {
+        std::vector<uint8_t> result(size);
+        for (auto &b : result)
+            b = (seed = seed * 1103515245 + 12345) >> 16;
+        return result;
+    };
+    auto bytes = random(20000);
+    dst.write(bytes);
+
+    // New records which are not in the destination, repeated
+    auto record = random(8000);
+    for (int i = 0; i < 3; ++i)
+        bytes.insert(bytes.begin() + 5000 + i * 9000, record.begin(), record.end());
+    src.write(bytes);
+
+    auto sig = dst.compactSignature(1000);
+    auto delta = src.delta(sig, size_t(-1), {});
+    size_t repeated = 0;
+    size_t literal = 0;
+    for (auto &chunk : delta.chunks) {
+        if (chunk.output) {
+            EXPECT_LE(chunk.src_pos + chunk.size, chunk.dst_pos);
+            repeated += chunk.size;
+        }
+        literal += chunk.data.size();
+    }
+    EXPECT_GE(repeated, 2 * 7000);
+    EXPECT_LT(literal, 8000 + 2 * 2000);
+
+    std::stringstream out;
+    delta.serialize(out);
+    syncopy::Delta delta2;
+    EXPECT_TRUE(delta2.deserialize(out));
+    EXPECT_EQ(delta, delta2);
+
+    // Literal data bigger than the stream is rejected before it is allocated
+    auto corrupt = out.str();
+    size_t data_size = size_t(1) << 60;
+    size_t offset = DELTA_HEADER.size() + sizeof(struct stat) + 2 * sizeof(size_t) + delta.md5.size() + 2 * sizeof(size_t);
+    memcpy(&corrupt[offset], &data_size, sizeof(data_size));
+    std::stringstream in(corrupt);
+    syncopy::Delta delta3;
+    EXPECT_FALSE(delta3.deserialize(in));
+    std::stringstream truncated(out.str().substr(0, out.str().size() - 20));
+    EXPECT_FALSE(delta3.deserialize(truncated));
+    std::stringstream old("syncopy::delta" + out.str().substr(DELTA_HEADER.size()));
+    EXPECT_FALSE(delta3.deserialize(old));
+
+    // Applied in parts
+    syncopy::Patcher patcher(dst.path());
+    EXPECT_TRUE(patcher.ok());
+    auto last = src.delta(sig, 4000, [&](syncopy::Delta &part) {
+        for (auto &chunk : part.chunks)
+            EXPECT_TRUE(patcher.apply(chunk));
+        return true;
+    });
+    for (auto &chunk : last.chunks)
+        EXPECT_TRUE(patcher.apply(chunk));
+    EXPECT_TRUE(patcher.commit(last.md5, last.st));
+    EXPECT_EQ(dst.readAll(), bytes);
+
+    // Copies of what is not written yet are rejected
+    syncopy::Patcher bad(dst.path());
+    syncopy::Delta::Chunk copy(500, 1000, {}, 1000);
+    copy.output = true;
+    EXPECT_TRUE(bad.apply({0, 0, {}, 1000}));
+    EXPECT_FALSE(bad.apply(copy));
+
+    dst.remove();
+    src.remove();
+}
+
+TEST(File, delta_repeated_period)
+{
+    syncopy::File dst("/tmp/delta_repeated_period1");
+    syncopy::File src("/tmp/delta_repeated_period2");
+
+    uint32_t seed = 1;
+    auto random = [&](size_t size) {
+        std::vector<uint8_t> result(size);
+        for (auto &b : result)
+            b = (seed = seed * 1103515245 + 12345) >> 16;
+        return result;
+    };
+    auto bytes = random(5000);
+    dst.write(bytes);
+
+    // A period between one and two windows, joined copies would overlap their destination
+    auto period = random(96);
+    for (int i = 0; i < 100; ++i)
+        bytes.insert(bytes.end() - 1000, period.begin(), period.end());
+    src.write(bytes);
+
+    auto sig = dst.compactSignature(64);
+    auto delta = src.delta(sig, size_t(-1), {});
+    size_t repeated = 0;
+    for (auto &chunk : delta.chunks) {
+        if (chunk.output) {
+            EXPECT_LE(chunk.src_pos + chunk.size, chunk.dst_pos);
+            repeated += chunk.size;
+        }
+    }
+    EXPECT_GE(repeated, 90 * 64);
+
+    auto old = dst.readAll();
+    EXPECT_TRUE(dst.patch(delta, 2));
+    EXPECT_EQ(dst.readAll(), bytes);
+
+    dst.write(old);
+    syncopy::Patcher patcher(dst.path());
+    for (auto &chunk : delta.chunks)
+        EXPECT_TRUE(patcher.apply(chunk));
+    EXPECT_TRUE(patcher.commit(delta.md5, delta.st));
+    EXPECT_EQ(dst.readAll(), bytes);
+
+    dst.remove();
+    src.remove();
+}
+
+TEST(File, patch_parallel)
+{
+    syncopy::File dst("/tmp/patch_parallel1");
+    syncopy::File src("/tmp/patch_parallel2");
+
+    uint32_t seed = 1;
+    auto random = [&](size_t size) {
+        std::vector<uint8_t> result(size);
+        for (auto &b : result)
+            b = (seed = seed * 1103515245 + 12345) >> 16;
+        return result;
+    };
+    auto bytes = random(3 * syncopy::Delta::SEGMENT);
+    dst.write(bytes);
+    auto sig = dst.compactSignature(4096);
+
+    // Inserts, a repeated record and a run of zeros
+    auto record = random(100000);
+    for (size_t pos : {9000000, 5000000, 1000000})
+        bytes.insert(bytes.begin() + pos, record.begin(), record.end());
+    bytes.insert(bytes.begin() + 7000000, 2 << 20, 0);
+    bytes.resize(bytes.size() - 12345);
+    src.write(bytes);
+
+    EXPECT_TRUE(src.delta(sig, size_t(-1), {}).segments.empty());
+    auto delta = src.delta(sig, size_t(-1), {}, true);
+    EXPECT_EQ(delta.segments.size(), (bytes.size() + syncopy::Delta::SEGMENT - 1) / syncopy::Delta::SEGMENT);
+    std::stringstream out;
+    delta.serialize(out);
+    syncopy::Delta delta2;
+    EXPECT_TRUE(delta2.deserialize(out));
+    EXPECT_EQ(delta2.segments, delta.segments);
+
+    auto old = dst.readAll();
+    EXPECT_TRUE(dst.patch(delta, 4));
+    EXPECT_EQ(dst.readAll(), bytes);
+    EXPECT_EQ(dst.md5(), delta.md5);
+
+    // Without segments the whole result is verified
+    dst.write(old);
+    delta.segments.clear();
+    EXPECT_TRUE(dst.patch(delta, 4));
+    EXPECT_EQ(dst.readAll(), bytes);
+
+    // A wrong segment keeps the file
+    dst.write(old);
+    delta = src.delta(sig, size_t(-1), {}, true);
+    delta.segments[1][0] ^= 1;
+    EXPECT_FALSE(dst.patch(delta, 4));
+    EXPECT_EQ(dst.readAll(), old);
+
+    dst.remove();
+    src.remove();
+}
+
+TEST(File, patch_flushed)
+{
+    syncopy::File dst("/tmp/patch_flushed1");
+    syncopy::File src("/tmp/patch_flushed2");
+
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 1000; ++i)
+        bytes.push_back(i * 31 % 251);
+
+    dst.write(bytes);
+    auto sig = dst.signature(16);
+
+    bytes.insert(bytes.begin() + 100, 300, 'x');
+    bytes.insert(bytes.end(), 500, 'y');
+    src.write(bytes);
+
+    syncopy::Patcher patcher(dst.path());
+    EXPECT_TRUE(patcher.ok());
+    size_t flushes = 0;
+    auto delta = src.delta(sig, 64, [&](syncopy::Delta &part) {
+        ++flushes;
+        for (auto &chunk : part.chunks)
+            EXPECT_TRUE(patcher.apply(chunk));
+        return true;
+    });
+    EXPECT_GT(flushes, 1);
+    for (auto &chunk : delta.chunks)
+        EXPECT_TRUE(patcher.apply(chunk));
+    EXPECT_TRUE(patcher.commit(delta.md5, delta.st));
+
+    EXPECT_EQ(md5(src.path()), md5(dst.path()));
+    EXPECT_EQ(dst.readAll(), bytes);
+
+    dst.remove();
+    src.remove();
+}
+
+
+TEST(File, md5)
+{
+    syncopy::File f("/tmp/md5");
+    f.write({});
+    EXPECT_EQ(f.md5(), "d41d8cd98f00b204e9800998ecf8427e");
+    f.write(std::vector<uint8_t>(100000, 'x'));
+    EXPECT_EQ(f.md5(), md5(f.path()));
+
+    // Prefixes
+    auto prefix = syncopy::checksum::md5(f.readAll().data(), 70000);
+    EXPECT_EQ(f.md5(70000), prefix);
+    EXPECT_EQ(f.md5(100000), f.md5());
+    EXPECT_TRUE(f.md5(100001).empty());
+
+    syncopy::HashCache cache;
+    EXPECT_EQ(cache.md5(f), md5(f.path()));
+    std::string cached;
+    EXPECT_TRUE(cache.find(f.path(), f.size(), f.mtime(), cached));
+    EXPECT_EQ(cached, md5(f.path()));
+    EXPECT_FALSE(cache.find(f.path(), f.size() + 1, f.mtime(), cached));
+
+    cache.rename(f.path(), "/tmp/md5_renamed");
+    EXPECT_FALSE(cache.find(f.path(), f.size(), f.mtime(), cached));
+    EXPECT_TRUE(cache.find("/tmp/md5_renamed", f.size(), f.mtime(), cached));
+
+    f.remove();
+}
+
+
+TEST(File, fuzzy)
+{
+    syncopy::File::mkdir("/tmp/fuzzy");
+    syncopy::File log1("/tmp/fuzzy/app.log.1");
+    syncopy::File other("/tmp/fuzzy/notes.txt");
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 1024; ++i)
+        bytes.push_back(i * 31 % 251);
+    log1.write(bytes);
+    other.write(bytes);
+
+    syncopy::File log2("/tmp/fuzzy/app.log.2");
+    EXPECT_EQ(log2.fuzzy(bytes.size()), log1.path());
+    EXPECT_EQ(syncopy::File("/tmp/fuzzy/image.png").fuzzy(bytes.size()), "");
+
+    // New file is patched using the similar file as a basis
+    bytes.insert(bytes.end(), 10, 'x');
+    syncopy::File src("/tmp/fuzzy_src");
+    src.write(bytes);
+    auto delta = src.delta(log1.signature(16));
+    EXPECT_EQ(delta.chunks.back().data.size(), 10);
+
+    syncopy::Patcher patcher(log2.path(), log1.path());
+    for (auto &chunk : delta.chunks)
+        EXPECT_TRUE(patcher.apply(chunk));
+    EXPECT_TRUE(patcher.commit(delta.md5, delta.st));
+    EXPECT_EQ(log2.readAll(), bytes);
+    EXPECT_TRUE(log1.exists());
+
+    src.remove();
+    syncopy::File::rmdir("/tmp/fuzzy");
+}
+
+TEST(File, sparse)
+{
+    syncopy::File f("/tmp/sparse/a");
+    std::vector<uint8_t> bytes(10000, 1);
+    f.write(bytes);
+    // 1MB hole in the middle and 1MB at the end
+    {
+        std::ofstream out(f.path(), std::ios::binary | std::ios::in);
+        out.seekp(10000 + (1 << 20));
+        out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    }
+    truncate(f.path().c_str(), 20000 + (2 << 20));
+    auto content = f.readAll();
+    ASSERT_EQ(content.size(), 20000 + (2 << 20));
+
+    auto extents = f.extents();
+    ASSERT_FALSE(extents.empty());
+    if (extents.size() == 1)
+        GTEST_SKIP() << "holes are not supported";
+
+    auto sig = f.signature(1000);
+    EXPECT_FALSE(sig.holes.empty());
+    EXPECT_LT(sig.chunks.size(), 100);
+
+    // Zero runs are not sent as literal data
+    syncopy::File g("/tmp/sparse/b");
+    g.write({});
+    auto delta = f.delta(g.signature(1000));
+    size_t literal = 0;
+    size_t zeros = 0;
+    for (auto &chunk : delta.chunks) {
+        literal += chunk.data.size();
+        zeros += chunk.zero() ? chunk.size : 0;
+    }
+    EXPECT_LT(literal, 30000);
+    EXPECT_GT(zeros, 2000000);
+
+    // The result keeps holes
+    syncopy::Patcher patcher(g.path());
+    patcher.sign(1000);
+    for (auto &chunk : delta.chunks)
+        EXPECT_TRUE(patcher.apply(chunk));
+    EXPECT_TRUE(patcher.commit(delta.md5, delta.st));
+    EXPECT_EQ(g.readAll(), content);
+    EXPECT_GT(g.extents().size(), 1);
+    EXPECT_EQ(patcher.signature().holes.size(), sig.holes.size());
+    EXPECT_LT(patcher.signature().chunks.size(), 100);
+
+    syncopy::File::rmdir("/tmp/sparse");
+}
+
+TEST(Signature, compact)
+{
+    syncopy::File f("/tmp/compact");
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 10050; ++i)
+        bytes.push_back(i * 13);
+    f.write(bytes);
+
+    auto sig = f.signature(100);
+    auto compact = f.compactSignature(100);
+    EXPECT_EQ(compact.size(), 101);
+    EXPECT_EQ(compact.pos(100), 10000);
+    EXPECT_EQ(compact.length(100), 50);
+    EXPECT_EQ(compact.end(), 10050);
+    EXPECT_EQ(compact.expand(), sig);
+    EXPECT_EQ(compact.hash, syncopy::CompactSignature::Hash::Rolling64);
+    EXPECT_EQ(syncopy::CompactSignature(sig), f.compactSignature(100, 0, size_t(-1), syncopy::CompactSignature::Hash::Adler32));
+    EXPECT_FALSE(syncopy::CompactSignature(sig) == compact);
+
+    std::stringstream out;
+    compact.serialize(out);
+    syncopy::CompactSignature compact2;
+    EXPECT_TRUE(compact2.deserialize(out));
+    EXPECT_EQ(compact, compact2);
+
+    // Windows of a session
+    auto parts = f.compactSignature(100, 0, 60);
+    parts.append(f.compactSignature(100, 6000, 60));
+    EXPECT_EQ(parts, compact);
+
+    // Blocks which do not follow each other keep their positions
+    syncopy::CompactSignature gaps;
+    gaps.window = 100;
+    gaps.push(0, 100, 1, compact.digest(0));
+    gaps.push(500, 100, 2, compact.digest(1));
+    EXPECT_EQ(gaps.pos(1), 500);
+    std::stringstream out2;
+    gaps.serialize(out2);
+    syncopy::CompactSignature gaps2;
+    EXPECT_TRUE(gaps2.deserialize(out2));
+    EXPECT_EQ(gaps2, gaps);
+    EXPECT_EQ(gaps2.pos(1), 500);
+
+    // A count bigger than the stream is rejected before anything is allocated
+    auto corrupt = out.str();
+    size_t count = size_t(1) << 60;
+    memcpy(&corrupt[COMPACT_SIGNATURE_HEADER.size() + sizeof(uint32_t)], &count, sizeof(count));
+    std::stringstream in(corrupt);
+    EXPECT_FALSE(compact2.deserialize(in));
+    std::stringstream truncated(out.str().substr(0, out.str().size() - 20));
+    EXPECT_FALSE(compact2.deserialize(truncated));
+
+    EXPECT_EQ(f.delta(compact, size_t(-1), {}), f.delta(sig));
+    f.remove();
+}
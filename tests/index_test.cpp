@@ -0,0 +1,120 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "file.h"
+#include "index.h"
+#include <gtest/gtest.h>
+
+TEST(Index, find)
+{
+    syncopy::File f("/tmp/index/a");
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 25; ++i)
+        bytes.push_back(i);
+    f.write(bytes);
+
+    auto sig = f.signature(10);
+    syncopy::Index index(10);
+    index.add(f.path(), sig);
+    // The last block is not full
+    EXPECT_EQ(index.size(), 2);
+
+    syncopy::Index::Location loc;
+    EXPECT_TRUE(index.find(sig.chunks[1].md5, loc));
+    EXPECT_EQ(loc.path, f.path());
+    EXPECT_EQ(loc.pos, 10);
+    EXPECT_EQ(loc.size, 10);
+    EXPECT_FALSE(index.find(sig.chunks[2].md5, loc));
+    EXPECT_FALSE(index.find("x", loc));
+
+    index.rename(f.path(), "/tmp/index/b");
+    EXPECT_TRUE(index.find(sig.chunks[0].md5, loc));
+    EXPECT_EQ(loc.path, "/tmp/index/b");
+
+    index.remove("/tmp/index");
+    EXPECT_EQ(index.size(), 0);
+    EXPECT_FALSE(index.find(sig.chunks[0].md5, loc));
+
+    syncopy::File::rmdir("/tmp/index");
+}
+
+TEST(Index, patch)
+{
+    syncopy::File other("/tmp/index_patch/other");
+    syncopy::File dst("/tmp/index_patch/dst");
+    syncopy::File src("/tmp/index_patch/src");
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 40; ++i)
+        bytes.push_back(i * 7);
+    other.write(bytes);
+    dst.write({});
+    src.write(bytes);
+
+    syncopy::Index index(10);
+    index.add(other.path(), other.signature(10));
+
+    // Literal blocks found in the index are copied from the other file
+    auto delta = src.delta(dst.signature(10));
+    EXPECT_EQ(delta.chunks.size(), 1);
+    syncopy::Patcher patcher(dst.path());
+    patcher.sign(10);
+    auto &data = delta.chunks[0].data;
+    for (size_t pos = 0; pos < data.size(); pos += 10) {
+        syncopy::Index::Location loc;
+        EXPECT_TRUE(index.find(syncopy::checksum::md5(data.data() + pos, 10), loc));
+        EXPECT_TRUE(patcher.apply({loc.pos, pos, {}, loc.size, loc.path}));
+    }
+    EXPECT_TRUE(patcher.commit(delta.md5, delta.st));
+    EXPECT_EQ(dst.readAll(), bytes);
+    EXPECT_EQ(patcher.signature(), dst.signature(10));
+
+    syncopy::File::rmdir("/tmp/index_patch");
+}
+
+TEST(Index, owners)
+{
+    syncopy::File a("/tmp/index_owners/a");
+    syncopy::File b("/tmp/index_owners/b");
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 30; ++i)
+        bytes.push_back(i * 3);
+    a.write(bytes);
+    b.write(bytes);
+
+    auto sig = a.signature(10);
+    syncopy::Index index(10);
+    index.add(a.path(), sig);
+    index.add(b.path(), b.compactSignature(10));
+    EXPECT_EQ(index.size(), 3);
+
+    // Blocks of a removed copy are still found in the other one
+    syncopy::Index::Location loc;
+    index.remove(a.path());
+    EXPECT_EQ(index.size(), 3);
+    EXPECT_TRUE(index.find(sig.chunks[1].md5, loc));
+    EXPECT_EQ(loc.path, b.path());
+    EXPECT_EQ(loc.pos, 10);
+
+    // A rewritten copy drops only blocks nobody else has
+    index.add(a.path(), sig);
+    bytes[0] += 1;
+    b.write(bytes);
+    index.add(b.path(), b.signature(10));
+    EXPECT_EQ(index.size(), 4);
+    EXPECT_TRUE(index.find(sig.chunks[0].md5, loc));
+    EXPECT_EQ(loc.path, a.path());
+
+    index.rename(a.path(), "/tmp/index_owners/c");
+    EXPECT_TRUE(index.find(sig.chunks[2].md5, loc));
+    EXPECT_TRUE(loc.path == b.path() || loc.path == "/tmp/index_owners/c");
+    index.remove(b.path());
+    EXPECT_TRUE(index.find(sig.chunks[2].md5, loc));
+    EXPECT_EQ(loc.path, "/tmp/index_owners/c");
+    EXPECT_EQ(index.size(), 3);
+
+    index.remove("/tmp/index_owners");
+    EXPECT_EQ(index.size(), 0);
+
+    syncopy::File::rmdir("/tmp/index_owners");
+}
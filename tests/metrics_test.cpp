@@ -0,0 +1,124 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "metrics.h"
+#include "file.h"
+#include <gtest/gtest.h>
+#include <fstream>
+#include <thread>
+
+TEST(Metrics, counters)
+{
+    auto &m = syncopy::Metrics::global();
+    auto &c = m.counter("test_events_total", "Events");
+    EXPECT_EQ(&c, &m.counter("test_events_total", "Events"));
+    EXPECT_NE(&c, &m.counter("test_events_total", "Events", "kind=\"a\""));
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back([&c] { for (int k = 0; k < 1000; ++k) c.add(); });
+    for (auto &t : threads)
+        t.join();
+    EXPECT_EQ(c.value(), 4000);
+
+    auto &g = m.gauge("test_depth", "Depth");
+    g.set(5);
+    g.add(-2);
+    EXPECT_EQ(g.value(), 3);
+
+    auto s = m.snapshot();
+    EXPECT_EQ(s["test_events_total"], 4000);
+    EXPECT_EQ(s["test_events_total{kind=\"a\"}"], 0);
+    EXPECT_EQ(s["test_depth"], 3);
+}
+
+TEST(Metrics, histogram)
+{
+    auto &m = syncopy::Metrics::global();
+    auto &h = m.histogram("test_seconds", "Durations", "method=\"x\"");
+    h.observe(0.00005);
+    h.observe(0.002);
+    h.observe(1000);
+    EXPECT_EQ(h.count(0), 1);
+    EXPECT_EQ(h.count(3), 2);
+    EXPECT_EQ(h.count(), 3);
+    EXPECT_NEAR(h.sum(), 1000.00205, 1e-6);
+
+    auto s = m.snapshot();
+    EXPECT_EQ(s["test_seconds_bucket{method=\"x\",le=\"0.0001\"}"], 1);
+    EXPECT_EQ(s["test_seconds_bucket{method=\"x\",le=\"+Inf\"}"], 3);
+    EXPECT_EQ(s["test_seconds_count{method=\"x\"}"], 3);
+
+    auto text = m.prometheus();
+    EXPECT_NE(text.find("# TYPE test_seconds histogram\n"), std::string::npos);
+    EXPECT_NE(text.find("test_seconds_bucket{method=\"x\",le=\"100\"} 2\n"), std::string::npos);
+    EXPECT_NE(text.find("# HELP test_events_total Events\n# TYPE test_events_total counter\n"), std::string::npos);
+
+    EXPECT_TRUE(m.dump("/tmp/metrics_test.prom"));
+    std::ifstream f("/tmp/metrics_test.prom");
+    std::string dumped((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    EXPECT_NE(dumped.find("test_seconds_count{method=\"x\"} 3"), std::string::npos);
+    syncopy::File("/tmp/metrics_test.prom").remove();
+}
+
+TEST(Metrics, delta)
+{
+    syncopy::File dst("/tmp/metrics_delta1");
+    syncopy::File src("/tmp/metrics_delta2");
+    std::vector<uint8_t> bytes(10000);
+    uint32_t seed = 1;
+    for (auto &b : bytes)
+        b = (seed = seed * 1103515245 + 12345) >> 16;
+    dst.write(bytes);
+    bytes.insert(bytes.begin() + 5500, 10, 1);
+    src.write(bytes);
+
+    auto before = syncopy::Metrics::global().snapshot();
+    auto delta = src.delta(dst.signature(1000));
+    EXPECT_TRUE(dst.patch(delta));
+    auto after = syncopy::Metrics::global().snapshot();
+    auto diff = [&](const std::string &name) { return after[name] - before[name]; };
+
+    EXPECT_EQ(diff("syncopy_delta_matched_bytes_total") + diff("syncopy_delta_literal_bytes_total"), bytes.size());
+    EXPECT_EQ(diff("syncopy_delta_matched_bytes_total"), 9000);
+    EXPECT_GE(diff("syncopy_delta_weak_hits_total{hash=\"adler32\"}"), 9);
+    EXPECT_EQ(diff("syncopy_signature_seconds_count"), 1);
+    EXPECT_EQ(diff("syncopy_delta_seconds_count"), 1);
+    EXPECT_EQ(diff("syncopy_patch_seconds_count"), 1);
+    EXPECT_EQ(diff("syncopy_patch_bytes_total"), bytes.size());
+
+    dst.remove();
+    src.remove();
+}
+
+TEST(Metrics, collisions)
+{
+    syncopy::File dst("/tmp/metrics_collisions1");
+    syncopy::File src("/tmp/metrics_collisions2");
+    // Few symbols make many windows with the same Adler32
+    std::vector<uint8_t> bytes(200000);
+    uint32_t seed = 1;
+    for (auto &b : bytes)
+        b = 'a' + ((seed = seed * 1103515245 + 12345) >> 16) % 4;
+    dst.write(bytes);
+    for (auto &b : bytes)
+        b = 'a' + ((seed = seed * 1103515245 + 12345) >> 16) % 4;
+    src.write(bytes);
+
+    auto misses = [&](syncopy::CompactSignature::Hash hash, const std::string &label) {
+        auto before = syncopy::Metrics::global().snapshot();
+        auto delta = src.delta(dst.compactSignature(64, 0, size_t(-1), hash), size_t(-1), {});
+        auto after = syncopy::Metrics::global().snapshot();
+        auto name = "syncopy_delta_strong_misses_total{hash=\"" + label + "\"}";
+        return after[name] - before[name];
+    };
+
+    auto adler32 = misses(syncopy::CompactSignature::Hash::Adler32, "adler32");
+    auto rolling64 = misses(syncopy::CompactSignature::Hash::Rolling64, "rolling64");
+    EXPECT_GT(adler32, 1000);
+    EXPECT_LT(rolling64, adler32 / 100);
+
+    dst.remove();
+    src.remove();
+}
@@ -0,0 +1,139 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "file.h"
+#include "reader.h"
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+static std::vector<uint8_t> readAll(const std::string &path, size_t offset, size_t length)
+{
+    std::vector<uint8_t> result;
+    auto reader = syncopy::Reader::open(path, offset, length);
+    if (!reader)
+        return result;
+
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    while (reader->next(data, size))
+        result.insert(result.end(), data, data + size);
+
+    return result;
+}
+
+TEST(Reader, backends)
+{
+    syncopy::File f("/tmp/reader/a");
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 10000; ++i)
+        bytes.push_back(i * 7);
+    f.write(bytes);
+
+    auto opts = syncopy::Reader::options;
+    for (auto backend : {syncopy::Reader::Backend::Pread, syncopy::Reader::Backend::Uring, syncopy::Reader::Backend::Mmap}) {
+        syncopy::Reader::options.backend = backend;
+        syncopy::Reader::options.block = 333;
+        syncopy::Reader::options.depth = 3;
+
+        EXPECT_EQ(readAll(f.path(), 0, size_t(-1)), bytes);
+        EXPECT_EQ(readAll(f.path(), 100, 1000), std::vector<uint8_t>(bytes.begin() + 100, bytes.begin() + 1100));
+        EXPECT_EQ(readAll(f.path(), 9990, 1000), std::vector<uint8_t>(bytes.begin() + 9990, bytes.end()));
+        EXPECT_TRUE(readAll(f.path(), 20000, 1000).empty());
+        EXPECT_TRUE(readAll("/tmp/reader/none", 0, size_t(-1)).empty());
+
+        // Signatures do not depend on how the file is read
+        syncopy::Reader::options.block = 1 << 20;
+        auto sig = f.signature(100);
+        syncopy::Reader::options.block = 333;
+        EXPECT_EQ(f.signature(100).chunks, sig.chunks);
+        EXPECT_EQ(f.delta(sig).chunks.size(), 100);
+        EXPECT_EQ(f.readAll(), bytes);
+
+        // Matched chunks are copied from the old file
+        syncopy::File g("/tmp/reader/b");
+        auto changed = bytes;
+        changed[5000] += 1;
+        g.write(changed);
+        auto delta = g.delta(sig);
+        size_t literal = 0;
+        for (auto &chunk : delta.chunks)
+            literal += chunk.data.size();
+        EXPECT_LE(literal, 200);
+        EXPECT_TRUE(f.patch(delta));
+        EXPECT_EQ(f.readAll(), changed);
+        f.write(bytes);
+    }
+    syncopy::Reader::options = opts;
+
+    syncopy::File::rmdir("/tmp/reader");
+}
+
+TEST(Reader, cache)
+{
+    syncopy::File f("/tmp/reader/a");
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < 10000; ++i)
+        bytes.push_back(i * 3);
+    f.write(bytes);
+
+    auto opts = syncopy::Reader::options;
+    for (auto cache : {syncopy::Reader::Cache::DontNeed, syncopy::Reader::Cache::Direct}) {
+        for (auto backend : {syncopy::Reader::Backend::Pread, syncopy::Reader::Backend::Uring, syncopy::Reader::Backend::Mmap}) {
+            syncopy::Reader::options.cache = cache;
+            syncopy::Reader::options.backend = backend;
+            // Unaligned blocks and ranges are aligned for O_DIRECT
+            syncopy::Reader::options.block = 5000;
+            syncopy::Reader::options.direct = 0;
+
+            EXPECT_EQ(readAll(f.path(), 0, size_t(-1)), bytes);
+            EXPECT_EQ(readAll(f.path(), 4097, 5000), std::vector<uint8_t>(bytes.begin() + 4097, bytes.begin() + 9097));
+            EXPECT_EQ(readAll(f.path(), 9999, 10), std::vector<uint8_t>(bytes.begin() + 9999, bytes.end()));
+
+            syncopy::File g("/tmp/reader/b");
+            g.write(bytes);
+            auto sig = g.signature(100);
+            auto changed = bytes;
+            changed[0] += 1;
+            f.write(changed);
+            EXPECT_TRUE(g.patch(f.delta(sig)));
+            EXPECT_EQ(g.readAll(), changed);
+            f.write(bytes);
+        }
+    }
+    syncopy::Reader::options = opts;
+
+    syncopy::File::rmdir("/tmp/reader");
+}
+
+TEST(Reader, truncated)
+{
+    syncopy::File f("/tmp/reader/a");
+    std::vector<uint8_t> bytes(100000, 1);
+    f.write(bytes);
+
+    auto opts = syncopy::Reader::options;
+    syncopy::Reader::options.backend = syncopy::Reader::Backend::Mmap;
+    auto reader = syncopy::Reader::open(f.path());
+    ASSERT_TRUE(reader);
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    ASSERT_TRUE(reader->next(data, size));
+    EXPECT_TRUE(reader->mapped());
+    EXPECT_FALSE(reader->truncated());
+
+    // Pages past the new end read as zeros instead of SIGBUS
+    EXPECT_EQ(truncate(f.path().c_str(), 10), 0);
+    size_t sum = 0;
+    for (size_t i = 0; i < size; ++i)
+        sum += data[i];
+    EXPECT_LT(sum, bytes.size());
+    EXPECT_TRUE(reader->truncated());
+    reader.reset();
+
+    // Not truncated after, the file is read again
+    EXPECT_EQ(f.readAll(), std::vector<uint8_t>(10, 1));
+    syncopy::Reader::options = opts;
+
+    syncopy::File::rmdir("/tmp/reader");
+}
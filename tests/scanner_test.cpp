@@ -0,0 +1,50 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "file.h"
+#include "scanner.h"
+#include <gtest/gtest.h>
+#include <set>
+#include <unistd.h>
+
+TEST(Scanner, scan)
+{
+    syncopy::File::mkdir("/tmp/scanner/a/b/c");
+    syncopy::File::mkdir("/tmp/scanner/d");
+    for (int i = 0; i < 50; ++i)
+        syncopy::File("/tmp/scanner/a/b/c/" + std::to_string(i)).write(std::vector<uint8_t>(i, 1));
+    syncopy::File("/tmp/scanner/a/x").write({1, 2, 3});
+    symlink("/tmp/scanner/a", "/tmp/scanner/link");
+
+    std::set<std::string> files;
+    std::set<std::string> dirs;
+    for (auto &e : syncopy::Scanner(4).scan("/tmp/scanner")) {
+        if (e.dir()) {
+            dirs.insert(e.path);
+            continue;
+        }
+
+        files.insert(e.path);
+        syncopy::File f(e.path);
+        EXPECT_EQ(e.size, f.size());
+        EXPECT_EQ(e.mtime, f.mtime());
+        EXPECT_EQ(e.mode, f.mode());
+        EXPECT_GT(e.inode, 0);
+    }
+
+    std::set<std::string> expected_files;
+    for (auto &f : syncopy::File::files("/tmp/scanner"))
+        expected_files.insert(f.path());
+    auto expected_dirs = syncopy::File::dirs("/tmp/scanner");
+
+    EXPECT_EQ(files.size(), 51);
+    EXPECT_EQ(files, expected_files);
+    // The symlinked dir is listed but not entered
+    EXPECT_EQ(dirs, std::set<std::string>(expected_dirs.begin(), expected_dirs.end()));
+    EXPECT_EQ(dirs.count("/tmp/scanner/link"), 1);
+
+    EXPECT_TRUE(syncopy::Scanner().scan("/tmp/scanner/none").empty());
+
+    syncopy::File::rmdir("/tmp/scanner");
+}
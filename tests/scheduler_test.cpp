@@ -0,0 +1,115 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "scheduler.h"
+#include <gtest/gtest.h>
+#include <thread>
+
+TEST(Scheduler, smallest_first)
+{
+    syncopy::Scheduler s(1);
+    s.push("big", 1000, 1);
+    s.push("small", 1, 1);
+    s.push("medium", 10, 1);
+    EXPECT_EQ(s.size(), 3);
+
+    syncopy::Scheduler::Job job;
+    EXPECT_TRUE(s.pop(0, job));
+    EXPECT_EQ(job.path, "small");
+    s.done(job);
+    EXPECT_TRUE(s.pop(0, job));
+    EXPECT_EQ(job.path, "medium");
+    s.done(job);
+    EXPECT_TRUE(s.pop(0, job));
+    EXPECT_EQ(job.path, "big");
+    EXPECT_EQ(job.size, 1000);
+    s.done(job);
+    EXPECT_EQ(s.size(), 0);
+}
+
+TEST(Scheduler, steal)
+{
+    syncopy::Scheduler s(2);
+    // Queued round-robin: "a" and "c" to the first worker, "b" to the second one
+    s.push("a", 1, 1);
+    s.push("b", 5, 1);
+    s.push("c", 2, 1);
+
+    syncopy::Scheduler::Job job;
+    EXPECT_TRUE(s.pop(1, job));
+    EXPECT_EQ(job.path, "b");
+    s.done(job);
+    EXPECT_TRUE(s.pop(1, job));
+    EXPECT_EQ(job.path, "c");
+    s.done(job);
+    EXPECT_TRUE(s.pop(1, job));
+    EXPECT_EQ(job.path, "a");
+    s.done(job);
+}
+
+TEST(Scheduler, dedup)
+{
+    syncopy::Scheduler s(1);
+    s.push("a", 1, 1);
+    s.push("a", 1, 1);
+    s.push("a", 2, 2);
+    EXPECT_EQ(s.size(), 1);
+
+    syncopy::Scheduler::Job job;
+    EXPECT_TRUE(s.pop(0, job));
+    EXPECT_EQ(job.path, "a");
+    EXPECT_EQ(job.size, 2);
+    s.done(job);
+    EXPECT_EQ(s.size(), 0);
+
+    s.stop();
+    EXPECT_FALSE(s.pop(0, job));
+}
+
+TEST(Scheduler, cancel)
+{
+    syncopy::Scheduler s(1);
+    s.push("a", 1, 1);
+
+    syncopy::Scheduler::Job job;
+    EXPECT_TRUE(s.pop(0, job));
+    // Still the same file
+    s.push("a", 1, 1);
+    EXPECT_FALSE(s.cancelled(job));
+    s.push("a", 3, 2);
+    EXPECT_TRUE(s.cancelled(job));
+    s.done(job);
+
+    EXPECT_TRUE(s.pop(0, job));
+    EXPECT_EQ(job.size, 3);
+    EXPECT_FALSE(s.cancelled(job));
+    s.done(job);
+    EXPECT_EQ(s.size(), 0);
+}
+
+TEST(Scheduler, threads)
+{
+    syncopy::Scheduler s(4);
+    std::atomic<size_t> count = {0};
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 4; ++i) {
+        threads.emplace_back([&s, &count, i] {
+            syncopy::Scheduler::Job job;
+            while (s.pop(i, job)) {
+                ++count;
+                s.done(job);
+            }
+        });
+    }
+
+    for (int i = 0; i < 1000; ++i)
+        s.push(std::to_string(i), i % 17, 1);
+    while (s.size() > 0)
+        std::this_thread::yield();
+    s.stop();
+    for (auto &t : threads)
+        t.join();
+
+    EXPECT_EQ(count, 1000);
+}
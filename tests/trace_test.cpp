@@ -0,0 +1,63 @@
+/*********************************************************
+ * Copyright (C) 2022, Val Doroshchuk <valbok@gmail.com> *
+ *********************************************************/
+
+#include "trace.h"
+#include "file.h"
+#include <gtest/gtest.h>
+#include <fstream>
+#include <thread>
+
+static size_t count(const std::string &name)
+{
+    size_t result = 0;
+    for (auto &e : syncopy::Trace::events())
+        result += e.name == name;
+    return result;
+}
+
+TEST(Trace, spans)
+{
+    {
+        syncopy::Span span("disabled");
+    }
+    EXPECT_EQ(count("disabled"), 0);
+
+    syncopy::Trace::enable(4);
+    syncopy::Trace::process("test");
+    {
+        syncopy::Span span("outer", "arg \"quoted\"");
+        syncopy::Span inner("inner");
+    }
+    auto events = syncopy::Trace::events();
+    ASSERT_EQ(events.size(), 2);
+    EXPECT_EQ(events[0].name, "outer");
+    EXPECT_EQ(events[0].arg, "arg \"quoted\"");
+    EXPECT_LE(events[0].ts, events[1].ts);
+    EXPECT_GE(events[0].dur, events[1].dur);
+
+    // Every thread has own ring, the oldest spans are overwritten
+    std::thread t([] {
+        syncopy::Trace::thread("worker");
+        for (int i = 0; i < 10; ++i)
+            syncopy::Span span("loop");
+    });
+    t.join();
+    EXPECT_EQ(count("loop"), 4);
+
+    syncopy::File f("/tmp/trace_spans");
+    f.write(std::vector<uint8_t>(5000, 1));
+    f.signature(1000);
+    EXPECT_EQ(count("signature"), 1);
+    f.remove();
+
+    EXPECT_TRUE(syncopy::Trace::dump("/tmp/trace_test.json"));
+    std::ifstream in("/tmp/trace_test.json");
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(json.find("{\"traceEvents\":["), 0);
+    EXPECT_NE(json.find("\"args\":{\"name\":\"worker\"}"), std::string::npos);
+    EXPECT_NE(json.find("\"args\":{\"name\":\"test\"}"), std::string::npos);
+    EXPECT_NE(json.find("\"args\":{\"arg\":\"arg \\\"quoted\\\"\"}"), std::string::npos);
+    EXPECT_NE(json.find("\"ph\":\"X\",\"name\":\"signature\",\"cat\":\"file\""), std::string::npos);
+    syncopy::File("/tmp/trace_test.json").remove();
+}